@@ -1,8 +1,23 @@
 #pragma once
 
 #include <sys/socket.h>
+#include <sys/types.h>
 #include <netinet/in.h>
 #include <memory.h>
+#include <string>
+#include <deque>
+#include <map>
+#include <vector>
+#include <protocol.h>
+
+// One entry of a client's output queue: either owned bytes or a range of
+// a file that is streamed with sendfile() without touching userspace
+struct OutSegment {
+    std::string bytes;
+    int file_fd = -1;
+    off_t file_off = 0;
+    size_t file_len = 0;
+};
 
 struct Client {
     int client_fd;
@@ -10,11 +25,62 @@ struct Client {
     socklen_t length = sizeof(address);
     int id;
 
+    // Reactor state, only touched with the server's clients mutex held
+    std::deque<OutSegment> out_queue;   // Output waiting for this client
+    size_t out_off = 0;         // How much of the front byte segment went out
+    bool want_write = false;    // EPOLLOUT currently registered
+    bool in_job = false;        // Taking part in the running job
+    bool payload_ready = false; // Has, or is being sent, the job payload
+    bool offer_pending = false; // PAYLOAD_OFFER not answered yet
+    bool relay_wait = false;    // Missing the payload, waiting for the relay tree
+    bool relay_pending = false; // A peer is relaying the payload to it
+    bool greeted = false;       // Sent HELLO, its capacity is known
+    uint16_t relay_port = 0;    // From HELLO, 0 if it cannot relay
+    uint16_t slots = 1;         // Tasks it may run at once, from HELLO
+    uint64_t memory_bytes = 0;  // From HELLO, 0 if unknown
+    uint32_t score = 0;         // Benchmark score from HELLO, 0 if unknown
+    std::vector<size_t> relay_subtree;  // Clients that get the payload through this one
+    bool can_reduce = false;    // From HELLO, folds output itself when asked to
+    bool aggregating = false;   // Part of the aggregation tree of the running job
+    int agg_parent = -1;        // Client its partials go to, -1 for the coordinator
+    std::map<uint32_t, size_t> tasks;   // Tasks in flight, output bytes received for each
+    FrameReader reader;         // Reassembles frames from the worker
+    bool closed = false;
+
+    // Liveness, in milliseconds of the server's monotonic clock
+    uint64_t last_heard = 0;    // Last time anything arrived or went out
+    uint64_t last_ping = 0;     // Last HEARTBEAT sent
+    uint64_t rtt_ms = 0;        // Round trip of the last answered HEARTBEAT
+
+    // Telemetry, only touched with the server's clients mutex held
+    uint64_t bytes_in = 0;      // Everything received from the worker
+    uint64_t bytes_out = 0;     // Everything sent to it, payload included
+    uint64_t range_start = 0;   // Latest range handed to it
+    uint64_t range_end = 0;
+
     Client() : client_fd(-1), id(-1) { memset(&address, 0, sizeof(address)); };
 
+    bool busy() const { return !tasks.empty(); }
+    bool has_slot() const { return tasks.size() < slots; }
+
     size_t send_buf(const char* buf, size_t file_size);
     size_t send_int(int value);
 
     size_t recv_buf(char* buf, size_t file_size);
-     
+
+    // Blocking framed I/O, returns false once the connection is gone
+    bool send_frame(MsgType type, const char* payload, size_t size);
+    bool recv_frame(Frame& frame);
+
+    // Blocking streamed reads: a header, then its payload in pieces
+    bool recv_header(MsgType& type, uint32_t& length);
+    ssize_t recv_some(char* buf, size_t size);
+
+    // Non-blocking output path used by the reactor
+    void queue_buf(const char* buf, size_t size);
+    void queue_frame(MsgType type, const char* payload, size_t size);
+    void queue_file(int fd, off_t offset, size_t size);
+    bool has_pending() const { return !out_queue.empty(); }
+    void clear_pending() { out_queue.clear(); out_off = 0; }
+    ssize_t flush();
 };
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <string>
+
+// Where PeerServer reports progress. The TUI draws it, headless runs print
+// it. Status lines come from the reactor as well as the thread driving
+// the job, the summary only from the latter.
+class EventSink {
+public:
+    virtual ~EventSink() {}
+
+    // One line of progress
+    virtual void add_status_message(const std::string& message) = 0;
+
+    // Replace the chunk size line shown above the status messages
+    virtual void set_scheduler_summary(const std::string& summary) = 0;
+};
+
+// Timestamped status lines on stdout, for running without a terminal
+class ConsoleSink : public EventSink {
+public:
+    void add_status_message(const std::string& message) override;
+    void set_scheduler_summary(const std::string& summary) override;
+
+private:
+    std::string last_summary;
+};
@@ -0,0 +1,188 @@
+#pragma once
+
+#include <utility>
+#include <stdint.h>
+#include <stddef.h>
+
+// Half-open [start, end) intervals with a value each, kept in a treap
+// ordered by (start, end) where every node also knows the largest end in
+// its subtree. Finding the intervals that overlap a query skips every
+// subtree that ends before it, so a lookup costs O(log n + matches).
+template <typename T>
+class IntervalTree {
+private:
+    struct Node {
+        uint64_t start;
+        uint64_t end;
+        uint64_t max_end;
+        uint32_t priority;
+        T value;
+        Node* left = nullptr;
+        Node* right = nullptr;
+    };
+
+    Node* root = nullptr;
+    size_t count = 0;
+    uint32_t seed = 2463534242u;
+
+    uint32_t next_priority() {
+        // xorshift32, only needs to look random to keep the treap balanced
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed;
+    }
+
+    static bool before(uint64_t start, uint64_t end, const Node* node) {
+        return start < node->start || (start == node->start && end < node->end);
+    }
+
+    static void update(Node* node) {
+        node->max_end = node->end;
+        if (node->left && node->left->max_end > node->max_end) {
+            node->max_end = node->left->max_end;
+        }
+        if (node->right && node->right->max_end > node->max_end) {
+            node->max_end = node->right->max_end;
+        }
+    }
+
+    static Node* rotate_right(Node* node) {
+        Node* top = node->left;
+        node->left = top->right;
+        top->right = node;
+        update(node);
+        update(top);
+        return top;
+    }
+
+    static Node* rotate_left(Node* node) {
+        Node* top = node->right;
+        node->right = top->left;
+        top->left = node;
+        update(node);
+        update(top);
+        return top;
+    }
+
+    Node* insert(Node* node, Node* fresh) {
+        if (!node) {
+            count++;
+            return fresh;
+        }
+        if (fresh->start == node->start && fresh->end == node->end) {
+            node->value = fresh->value;
+            delete fresh;
+            return node;
+        }
+        if (before(fresh->start, fresh->end, node)) {
+            node->left = insert(node->left, fresh);
+            if (node->left->priority > node->priority) {
+                return rotate_right(node);
+            }
+        } else {
+            node->right = insert(node->right, fresh);
+            if (node->right->priority > node->priority) {
+                return rotate_left(node);
+            }
+        }
+        update(node);
+        return node;
+    }
+
+    static Node* merge(Node* a, Node* b) {
+        if (!a) {
+            return b;
+        }
+        if (!b) {
+            return a;
+        }
+        if (a->priority > b->priority) {
+            a->right = merge(a->right, b);
+            update(a);
+            return a;
+        }
+        b->left = merge(a, b->left);
+        update(b);
+        return b;
+    }
+
+    Node* erase(Node* node, uint64_t start, uint64_t end) {
+        if (!node) {
+            return nullptr;
+        }
+        if (start == node->start && end == node->end) {
+            Node* rest = merge(node->left, node->right);
+            delete node;
+            count--;
+            return rest;
+        }
+        if (before(start, end, node)) {
+            node->left = erase(node->left, start, end);
+        } else {
+            node->right = erase(node->right, start, end);
+        }
+        update(node);
+        return node;
+    }
+
+    template <typename F>
+    static void overlapping(const Node* node, uint64_t start, uint64_t end, F& visit) {
+        // Nothing below ends after the query starts
+        if (!node || node->max_end <= start) {
+            return;
+        }
+        overlapping(node->left, start, end, visit);
+        if (node->start >= end) {
+            return;
+        }
+        if (node->end > start) {
+            visit(node->start, node->end, node->value);
+        }
+        overlapping(node->right, start, end, visit);
+    }
+
+    static void destroy(Node* node) {
+        if (node) {
+            destroy(node->left);
+            destroy(node->right);
+            delete node;
+        }
+    }
+
+public:
+    IntervalTree() {}
+    IntervalTree(const IntervalTree&) = delete;
+    IntervalTree& operator=(const IntervalTree&) = delete;
+    ~IntervalTree() { clear(); }
+
+    // Adds [start, end), or replaces the value of that exact interval
+    void insert(uint64_t start, uint64_t end, const T& value) {
+        Node* fresh = new Node{start, end, end, next_priority(), value};
+        root = insert(root, fresh);
+    }
+
+    // Removes exactly [start, end) if present
+    void erase(uint64_t start, uint64_t end) { root = erase(root, start, end); }
+
+    bool contains(uint64_t start, uint64_t end) const {
+        const Node* node = root;
+        while (node && !(node->start == start && node->end == end)) {
+            node = before(start, end, node) ? node->left : node->right;
+        }
+        return node != nullptr;
+    }
+
+    // Calls visit(start, end, value) for every interval sharing an item
+    // with [start, end), in order of start
+    template <typename F>
+    void overlapping(uint64_t start, uint64_t end, F visit) const { overlapping(root, start, end, visit); }
+
+    size_t size() const { return count; }
+
+    void clear() {
+        destroy(root);
+        root = nullptr;
+        count = 0;
+    }
+};
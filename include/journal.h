@@ -0,0 +1,92 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <utility>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <reducer.h>
+
+constexpr const char* JOURNAL_FILE = "peerpulse.journal";
+
+// Records are batched and reach the disk with one fsync at most this long
+// after they were appended
+constexpr int JOURNAL_SYNC_MS = 500;
+
+// Record type, the first byte of every record
+enum class JournalRecord : uint8_t {
+    JOB = 1,        // 20 byte payload SHA-1, uint64 item count, uint8 reduce op, uint32 top k
+    PREFIX = 2,     // uint64 items, uint64 bytes: items [0, items) fill that much of the result file
+    FOLD = 3,       // uint32 count, (uint64 start, uint64 end) ranges, their folded partial
+    END = 4,        // The job finished, nothing to resume
+};
+
+// What makes two runs the same job
+struct JobKey {
+    std::string digest;
+    uint64_t items;
+    uint8_t op;
+    uint32_t k;
+};
+
+typedef std::pair<uint64_t, uint64_t> ItemRange;
+
+// Progress of an interrupted job, read back from its journal
+struct JournalState {
+    uint64_t prefix_items = 0;      // Items whose output is at the start of the result file
+    uint64_t prefix_bytes = 0;
+    std::vector<ItemRange> folded;  // Disjoint ranges whose partials went into the reducer
+};
+
+// Append-only log of the progress of the running job, so a coordinator
+// that crashed or was quit can pick the job up where it left off.
+// Records are framed as uint8 type, uint32 length, payload and a uint32
+// FNV-1a checksum, so a torn tail is recognized and ignored. Callers
+// append from the reactor without touching the disk; a thread of its own
+// writes each batch and syncs it, syncing the result file first so a
+// PREFIX never points past output that was lost.
+class Journal {
+private:
+    int fd = -1;
+    int result_fd = -1;         // Read-only, only to sync the result file
+    std::string pending;        // Appended, not written yet
+    bool stopping = false;
+    pthread_t thread;
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+    void sync_loop();
+    void write_batch(const std::string& batch);
+
+    static void *sync_thread_fn(void *v) {
+        static_cast<Journal*>(v)->sync_loop();
+        return NULL;
+    }
+
+public:
+    ~Journal() { close(); }
+
+    // Starts a fresh journal at path holding initial, written and synced
+    // before this returns. result_path is synced ahead of every batch.
+    bool open(const std::string& path, const std::string& result_path, const std::string& initial);
+    bool is_open() const { return fd >= 0; }
+
+    void append(JournalRecord type, const std::string& payload);
+
+    // Writes what is still pending, syncs it and stops the thread
+    void close();
+
+    // One framed record, for the initial contents given to open()
+    static std::string record(JournalRecord type, const std::string& payload);
+    static std::string job(const JobKey& key);
+    static std::string prefix(uint64_t items, uint64_t bytes);
+    static std::string fold(const std::vector<ItemRange>& ranges, const Partial& partial);
+
+    // Replays the journal at path if it belongs to key and the job did not
+    // finish. Folded partials go into reducer, which the caller resets when
+    // this returns false. A PREFIX beyond result_size, the length of the
+    // result file now, is output that never made it and is passed over.
+    static bool recover(const std::string& path, const JobKey& key, uint64_t result_size,
+                        ResultReducer& reducer, JournalState& state);
+};
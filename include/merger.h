@@ -0,0 +1,104 @@
+#pragma once
+
+#include <map>
+#include <queue>
+#include <vector>
+#include <string>
+#include <stdint.h>
+#include <stddef.h>
+#include <writer.h>
+#include <range_cache.h>
+
+constexpr size_t MERGE_MEMORY_BUDGET = 64 * 1024 * 1024;
+
+// Puts task output back into item order. Every task attempt stages its
+// output under its (start, end) range; committed ranges wait in a min-heap
+// keyed by start and are written out as soon as they continue the range
+// already written, so the file reads as if one process had run the whole
+// job. Staged output stays in memory until the budget is spent, after
+// which attempts spill to unlinked temp files. Ranges an earlier job left
+// in the result cache are streamed from there in their turn, and runs
+// written fresh are handed to the cache.
+//
+// Not thread safe, the reactor is its only user.
+class ResultMerger {
+private:
+    struct Run {
+        uint64_t start;
+        uint64_t end;
+        std::string data;       // In memory part, empty once spilled
+        int spill_fd = -1;
+        uint64_t size = 0;
+        std::string path;       // Output served from the result cache
+        bool cacheable = true;
+    };
+
+    struct LaterStart {
+        bool operator()(const Run* a, const Run* b) const { return a->start > b->start; }
+    };
+
+    ResultWriter& out;
+    RangeCache* cache = nullptr;        // Gets a copy of every fresh run written
+    std::string spill_dir;
+    size_t memory_budget;
+    size_t memory_used = 0;
+    size_t spill_count = 0;
+
+    std::map<uint32_t, Run*> staging;   // Attempts still running
+    std::priority_queue<Run*, std::vector<Run*>, LaterStart> committed;
+    uint64_t cursor = 0;                // Everything before this has been written
+    uint64_t written = 0;               // Bytes written for it
+    uint64_t gaps = 0;                  // Items with no output when the job ended
+    std::vector<CachedRange> lost;      // Cached ranges whose file was gone, not written
+
+    bool spill(Run* run);
+    bool emit(Run* run);
+    void release(Run* run);
+    void drain();
+
+public:
+    ResultMerger(ResultWriter& out, size_t memory_budget = MERGE_MEMORY_BUDGET);
+    ~ResultMerger();
+
+    // Drops anything staged and starts a job at item `first`, whose output
+    // before it already takes up `bytes`
+    void reset(uint64_t first, uint64_t bytes = 0);
+
+    void begin(uint32_t attempt, uint64_t start, uint64_t end);
+    void append(uint32_t attempt, const char* data, size_t len);
+
+    // The attempt finished, its output joins the merge
+    void commit(uint32_t attempt);
+
+    // The attempt failed, its output is thrown away
+    void abort(uint32_t attempt);
+
+    // A range with no output to wait for, done by an earlier run of the job
+    void skip(uint64_t start, uint64_t end);
+
+    // A range whose output is in the result cache at path
+    void cached(uint64_t start, uint64_t end, const std::string& path, uint64_t size);
+
+    // Cached ranges whose file was missing or changed when their turn came.
+    // Nothing of theirs was written and the merge waits at their start
+    // until they are run again.
+    std::vector<CachedRange> take_lost();
+
+    // Where runs written from now on are copied to, nullptr for nowhere
+    void set_cache(RangeCache* cache) { this->cache = cache; }
+
+    // The attempt's output is not worth remembering, its task failed
+    void keep_uncached(uint32_t attempt);
+
+    // Writes whatever is still waiting, in order, and counts the items
+    // up to `last` that never produced a committed range
+    void finish(uint64_t last);
+
+    // Items and bytes written out in order so far
+    uint64_t written_items() const { return cursor; }
+    uint64_t written_bytes() const { return written; }
+
+    size_t staged_bytes() const { return memory_used; }
+    size_t spilled_runs() const { return spill_count; }
+    uint64_t missing_items() const { return gaps; }
+};
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+// Cells per metric, threads are spread over them so they rarely share one
+constexpr size_t METRIC_SHARDS = 16;
+
+// Upper bounds in seconds of the task latency buckets, +Inf is implied
+constexpr double LATENCY_BUCKETS[] = {0.01, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 120};
+constexpr size_t LATENCY_BUCKET_COUNT = sizeof(LATENCY_BUCKETS) / sizeof(LATENCY_BUCKETS[0]);
+
+// Shard of the calling thread, fixed the first time it touches a metric
+size_t metric_shard();
+
+// Monotonic counter. Each thread adds to its own cache line with a relaxed
+// atomic, a scrape sums the shards.
+class Counter {
+private:
+    struct alignas(64) Cell {
+        std::atomic<uint64_t> value{0};
+    };
+    Cell cells[METRIC_SHARDS];
+
+public:
+    void add(uint64_t n = 1) { cells[metric_shard()].value.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t value() const;
+};
+
+// A value that goes up and down, set by whoever owns it
+class Gauge {
+private:
+    std::atomic<int64_t> current{0};
+
+public:
+    void set(int64_t value) { current.store(value, std::memory_order_relaxed); }
+    void add(int64_t n) { current.fetch_add(n, std::memory_order_relaxed); }
+    int64_t value() const { return current.load(std::memory_order_relaxed); }
+};
+
+// Task latencies in fixed buckets, sharded like Counter
+class Histogram {
+private:
+    struct alignas(64) Cell {
+        std::atomic<uint64_t> buckets[LATENCY_BUCKET_COUNT + 1] = {};
+        std::atomic<uint64_t> sum_us{0};
+    };
+    Cell cells[METRIC_SHARDS];
+
+public:
+    void observe(double seconds);
+
+    // Prometheus text lines for the cumulative buckets, sum and count
+    void render(std::string& out, const char* name) const;
+};
+
+// Everything the coordinator exports. Updated from the reactor and job
+// threads without locks, read by the exporter thread.
+struct ServerMetrics {
+    Counter tasks_dispatched;
+    Counter tasks_completed;
+    Counter tasks_failed;
+    Counter task_retries;
+    Counter task_backups;
+    Counter bytes_sent;
+    Counter bytes_received;
+    Histogram task_seconds;
+    Gauge workers_connected;
+    Gauge queue_items;          // Items not handed out yet
+    Gauge tasks_in_flight;
+    Gauge items_done;           // Completed by workers this job, departed ones included
+
+    // The Prometheus text exposition format
+    std::string render() const;
+};
+
+// Serves ServerMetrics as text over HTTP on the loopback interface, one
+// short blocking connection at a time from its own thread.
+class MetricsExporter {
+private:
+    const ServerMetrics& metrics;
+    int listen_fd = -1;
+    int wake_fd = -1;
+    pthread_t thread;
+    std::atomic<bool> running{false};
+
+    void serve_loop();
+    void serve(int fd);
+
+    static void *serve_thread_fn(void *v) {
+        static_cast<MetricsExporter*>(v)->serve_loop();
+        return NULL;
+    }
+
+public:
+    explicit MetricsExporter(const ServerMetrics& metrics) : metrics(metrics) {}
+    ~MetricsExporter() { stop(); }
+
+    // Binds 127.0.0.1:port and starts the thread, false if the port is taken
+    bool start(uint16_t port);
+    void stop();
+};
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <boost/uuid/detail/sha1.hpp>
+
+// Wire format shared by the coordinator and workers. Every message is a
+// 5 byte header followed by its payload:
+//
+//   uint32 payload length (network byte order) | uint8 message type
+//
+// All integers inside payloads are big-endian as well.
+enum class MsgType : uint8_t {
+    SCRIPT = 1,        // Raw job payload
+    TASK_RANGE = 2,    // uint32 task id, uint64 start, uint64 end (end exclusive)
+    RESULT_CHUNK = 3,  // uint32 task id, output bytes
+    DONE = 4,          // uint32 task id, int32 exit status (TASK_NOT_RUN: no status), uint64 output bytes
+    HEARTBEAT = 5,     // Opaque bytes, echoed back by the receiver
+    PAYLOAD_OFFER = 6, // 20 byte SHA-1 of the payload, uint64 size
+    PAYLOAD_STATUS = 7,// 20 byte SHA-1, uint8 1 if cached, 0 if SCRIPT is needed
+    HELLO = 8,         // uint16 relay port (0 if the worker cannot relay), uint16 task slots,
+                       // uint64 memory bytes, uint32 benchmark score (0 if not measured),
+                       // uint8 HELLO_* capability flags
+    RELAY = 9,         // uint8 fanout, uint32 count, endpoints of the receiver's subtree
+    RELAY_FAILED = 10, // uint32 count, endpoints a relay could not deliver to
+    CANCEL = 11,       // uint32 task id, stop it without sending DONE
+    AGGREGATE = 12,    // uint8 reduce op, uint32 top k, endpoint to send partials to (port 0: the coordinator)
+    PARTIAL = 13,      // uint32 count, task ids, folded result of those tasks (see reducer.h)
+};
+
+// Highest type a FrameReader accepts
+constexpr MsgType LAST_MSG_TYPE = MsgType::PARTIAL;
+
+// HELLO capabilities
+constexpr uint8_t HELLO_CAN_REDUCE = 1;     // Folds its own output and aggregates peers' on AGGREGATE
+
+constexpr size_t DIGEST_SIZE = 20;
+
+constexpr size_t FRAME_HEADER_SIZE = 5;
+constexpr uint32_t MAX_FRAME_SIZE = 1u << 30;
+
+struct Frame {
+    MsgType type;
+    std::string payload;
+};
+
+struct TaskRange {
+    uint32_t task_id;
+    uint64_t start;
+    uint64_t end;
+};
+
+// DONE status of a task whose process could not be started or was lost
+// before it exited. Its output is not the range's and it runs again;
+// exit statuses are never negative.
+constexpr int32_t TASK_NOT_RUN = -1;
+
+// End-of-task marker, bytes is the total RESULT_CHUNK output for the task
+struct TaskDone {
+    uint32_t task_id;
+    int32_t status;
+    uint64_t bytes;
+};
+
+struct PayloadOffer {
+    std::string digest;
+    uint64_t size;
+};
+
+struct PayloadStatus {
+    std::string digest;
+    bool cached;
+};
+
+// What a worker advertises about itself. Older workers only send the
+// relay port, the rest then defaults to a single slot and no score.
+struct Hello {
+    uint16_t relay_port;
+    uint16_t slots = 1;         // Tasks it runs at once, normally one per core
+    uint64_t memory_bytes = 0;  // Physical memory, 0 if unknown
+    uint32_t score = 0;         // Single core benchmark, higher is faster
+    uint8_t flags = 0;          // HELLO_* capabilities
+};
+
+// A worker's relay listener. addr is an IPv4 address in network byte order.
+struct Endpoint {
+    uint32_t addr;
+    uint16_t port;
+
+    bool operator==(const Endpoint& other) const { return addr == other.addr && port == other.port; }
+};
+
+// Payload fan-out tree. Nodes are laid out as an implicit k-ary heap:
+// position 0 is the sender and the children of p are k*p+1 .. k*p+k. A
+// RELAY frame carries the receiver's descendants in breadth-first order,
+// which is again such a heap with the receiver at position 0.
+struct RelayPlan {
+    uint8_t fanout;
+    std::vector<Endpoint> descendants;
+};
+
+// Reduction assignment. The worker folds its own task output with op and
+// sends PARTIAL frames, together with what its children in the
+// aggregation tree sent it, to parent, or to the coordinator when
+// parent.port is 0.
+struct AggregatePlan {
+    uint8_t op;
+    uint32_t k;
+    Endpoint parent;
+};
+
+// Breadth-first positions of the descendants of pos in a heap of
+// positions 0 .. count
+std::vector<size_t> relay_subtree(size_t pos, size_t count, size_t fanout);
+
+// Big-endian field helpers
+void put_u32(std::string& out, uint32_t value);
+void put_u64(std::string& out, uint64_t value);
+uint32_t get_u32(const char* p);
+uint64_t get_u64(const char* p);
+
+void encode_header(char* out, MsgType type, uint32_t length);
+std::string encode_frame(MsgType type, const char* payload, size_t length);
+
+std::string encode_task_range(const TaskRange& range);
+bool decode_task_range(const std::string& payload, TaskRange& range);
+std::string encode_done(const TaskDone& done);
+bool decode_done(const std::string& payload, TaskDone& done);
+
+std::string encode_payload_offer(const PayloadOffer& offer);
+bool decode_payload_offer(const std::string& payload, PayloadOffer& offer);
+std::string encode_payload_status(const PayloadStatus& status);
+bool decode_payload_status(const std::string& payload, PayloadStatus& status);
+
+std::string encode_hello(const Hello& hello);
+bool decode_hello(const std::string& payload, Hello& hello);
+std::string encode_endpoints(const std::vector<Endpoint>& endpoints);
+bool decode_endpoints(const std::string& payload, size_t offset, std::vector<Endpoint>& endpoints);
+std::string encode_relay_plan(const RelayPlan& plan);
+bool decode_relay_plan(const std::string& payload, RelayPlan& plan);
+std::string encode_aggregate_plan(const AggregatePlan& plan);
+bool decode_aggregate_plan(const std::string& payload, AggregatePlan& plan);
+
+// Content address of a payload: raw SHA-1 bytes and their hex form
+std::string digest_payload(const char* data, size_t size);
+std::string digest_hex(const std::string& digest);
+
+// Incremental form of digest_payload() for payloads that are streamed
+class PayloadHasher {
+private:
+    boost::uuids::detail::sha1 sha;
+
+public:
+    void update(const char* data, size_t size) { sha.process_bytes(data, size); }
+    std::string digest();
+};
+
+// Reassembles frames from an arbitrarily split byte stream
+class FrameReader {
+private:
+    std::string buf;
+    size_t off = 0;
+
+public:
+    void feed(const char* data, size_t length);
+
+    // Returns 1 and fills frame when a full frame is buffered, 0 when more
+    // bytes are needed and -1 when the stream is malformed
+    int next(Frame& frame);
+
+    // Like next() but only consumes the header, leaving the payload to be
+    // pulled with take(). Used to stream large payloads.
+    int next_header(MsgType& type, uint32_t& length);
+    size_t take(char* out, size_t max);
+    size_t buffered() const { return buf.size() - off; }
+};
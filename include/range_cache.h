@@ -0,0 +1,101 @@
+#pragma once
+
+#include <deque>
+#include <vector>
+#include <string>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <interval_tree.h>
+
+// Result cache budget unless told otherwise, 0 turns it off
+constexpr uint64_t RESULT_CACHE_BYTES = 1ull << 30;
+
+// Output waiting for the cache thread beyond this is not cached, so a slow
+// disk never holds up the merge
+constexpr size_t RESULT_CACHE_QUEUE_BYTES = 64 * 1024 * 1024;
+
+// One cached range, the output of items [start, end) in a file of its own
+struct CachedRange {
+    uint64_t start;
+    uint64_t end;
+    uint64_t bytes;
+    std::string path;
+};
+
+// Output of earlier runs per item range, kept on disk across jobs and
+// restarts under ~/.cache/peerpulse/results. Each job key (payload hash
+// and parameters) gets a directory with one <start>-<end>.out file per
+// range, the directory listing is the index. The ranges of the selected
+// key live in an interval tree, so a job finds what overlaps it without
+// walking everything cached. Files are written by a thread of their own
+// and the least recently used are dropped once the cache outgrows its
+// budget.
+//
+// select(), cover() and trim() belong to the thread starting jobs, store()
+// to the reactor, both under the server's lock.
+class RangeCache {
+private:
+    struct Store {
+        uint64_t start;
+        uint64_t end;
+        std::string data;       // In memory output
+        int fd = -1;            // Or a spill file holding size bytes, owned here
+        uint64_t size = 0;
+        std::string dir;
+    };
+
+    std::string root;
+    uint64_t max_bytes = RESULT_CACHE_BYTES;
+    std::string dir;                        // Directory of the selected key
+    IntervalTree<uint64_t> index;           // Ranges of the selected key, valued by size
+
+    std::deque<Store> queue;
+    size_t queued_bytes = 0;
+    bool busy = false;                      // The thread is writing an entry
+    bool stopping = false;
+    bool started = false;
+    pthread_t thread;
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+    pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+
+    void store_loop();
+    void write_entry(Store& entry);
+    std::string entry_path(uint64_t start, uint64_t end) const;
+
+    static void *store_thread_fn(void *v) {
+        static_cast<RangeCache*>(v)->store_loop();
+        return NULL;
+    }
+
+public:
+    RangeCache();
+    ~RangeCache();
+
+    // 0 turns the cache off
+    void set_max_bytes(uint64_t bytes) { max_bytes = bytes; }
+    bool enabled() const { return max_bytes > 0; }
+
+    // Loads the ranges cached for a job key, after waiting for pending writes
+    bool select(const std::string& key);
+
+    // The disjoint cached ranges inside [start, end) covering the most items.
+    // Marks them recently used.
+    std::vector<CachedRange> cover(uint64_t start, uint64_t end);
+
+    // Queues the output of [start, end) for the selected key, dropped when
+    // the range is already cached or the queue is full. fd, when not -1, is
+    // a file holding size bytes that the cache takes over.
+    void store(uint64_t start, uint64_t end, std::string&& data);
+    void store(uint64_t start, uint64_t end, int fd, uint64_t size);
+
+    // Drops a range whose file turned out missing or damaged
+    void forget(uint64_t start, uint64_t end);
+
+    // Blocks until every queued range is on disk
+    void flush();
+
+    // Drops least recently used ranges of every key until within budget
+    void trim();
+};
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <map>
+#include <vector>
+#include <string>
+#include <utility>
+#include <stdint.h>
+#include <stddef.h>
+
+// Record a task writes to stdout when the job is reduced: uint64 key and
+// IEEE 754 float64 value, both big-endian. Python: struct.pack("!Qd", key, value)
+constexpr size_t REDUCE_RECORD_SIZE = 16;
+
+enum class ReduceOp : uint8_t {
+    CONCAT = 0,     // No reduction, output is merged in item order as text
+    SUM = 1,        // Sum and count of the values
+    MIN = 2,        // Smallest value and its key
+    MAX = 3,        // Largest value and its key
+    TOPK = 4,       // The k largest values with their keys
+    HISTOGRAM = 5,  // Values summed per key, keys are bins
+};
+
+// Parses "sum", "min", "max", "topk:K", "histogram" or "concat"
+bool parse_reduce(const std::string& spec, ReduceOp& op, size_t& k);
+const char* reduce_name(ReduceOp op);
+
+// What has been folded so far, for one task attempt or the whole job
+struct Partial {
+    uint64_t count = 0;                         // Records folded
+    double value = 0;                           // Sum, or the min / max
+    uint64_t key = 0;                           // Key of the min / max
+    std::vector<std::pair<double, uint64_t>> top;   // Min-heap of the k largest
+    std::map<uint64_t, double> bins;
+};
+
+// PARTIAL payload: the task ids a partial covers, then the partial itself
+std::string encode_partial_batch(const std::vector<uint32_t>& task_ids, const Partial& partial);
+bool decode_partial_batch(const std::string& payload, std::vector<uint32_t>& task_ids, Partial& partial);
+
+// Folds typed result records as they stream in, so a reduced job never
+// keeps its raw output. Every attempt folds into a partial of its own that
+// joins the job total only when the attempt commits; a failed attempt or
+// the losing copy of a backed up task is dropped without a trace.
+//
+// Workers use the same class to fold their own output and aggregate
+// their subtree's before forwarding it up the aggregation tree.
+//
+// Not thread safe, callers serialize access.
+class ResultReducer {
+private:
+    struct Attempt {
+        Partial partial;
+        std::string tail;       // Start of a record split across chunks
+    };
+
+    ReduceOp op = ReduceOp::CONCAT;
+    size_t k = 10;
+    Partial total;
+    std::map<uint32_t, Attempt> staging;
+    uint64_t stray_bytes = 0;   // Committed output that did not fill a whole record
+
+    void fold(Partial& partial, uint64_t key, double value) const;
+    void merge(Partial& into, const Partial& from) const;
+
+public:
+    void configure(ReduceOp op, size_t k);
+    bool active() const { return op != ReduceOp::CONCAT; }
+    ReduceOp get_op() const { return op; }
+    size_t get_k() const { return k; }
+
+    // Drops everything folded and staged, for the next job
+    void reset();
+
+    void begin(uint32_t attempt);
+    void append(uint32_t attempt, const char* data, size_t len);
+
+    // The attempt finished, its partial joins the total and is returned
+    Partial commit(uint32_t attempt);
+
+    // The attempt failed, its partial is thrown away
+    void abort(uint32_t attempt);
+
+    // Folds in a partial that was already reduced elsewhere
+    void absorb(const Partial& partial) { merge(total, partial); }
+
+    // Hands over the total folded so far and starts a new one, for
+    // forwarding up an aggregation tree
+    Partial take();
+
+    // The final answer as text, one line per value
+    std::string render() const;
+
+    const Partial& current() const { return total; }
+    uint64_t records() const { return total.count; }
+    uint64_t malformed_bytes() const { return stray_bytes; }
+};
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <chrono>
+#include <map>
+#include <vector>
+
+// A contiguous, half open range of items handed to one worker
+struct Task {
+    uint32_t id;
+    uint64_t start;
+    uint64_t end;
+    uint32_t retries;   // Times these items were handed out and lost before
+};
+
+// Per-worker throughput as measured by the queue. Rates are per task
+// slot, a worker running several tasks at once gets through slots times
+// as many items.
+struct WorkerRate {
+    double items_per_sec = 0;   // Smoothed, 0 until the first task completes
+    uint64_t last_chunk = 0;    // Size of the most recent range handed out
+    uint64_t items_done = 0;
+    uint32_t slots = 1;         // Advertised by the worker
+    uint32_t score = 0;         // Advertised benchmark score, 0 if unknown
+};
+
+// Coordinator-side work queue. Every worker owns a reservation of the item
+// space, sized by its advertised capacity, and pulls ranges off its front
+// on demand. A worker whose
+// reservation runs dry steals the back half of the largest reservation
+// left, so fast machines keep taking work from slow ones until the whole
+// range has been handed out.
+//
+// Range sizes adapt to each worker: the queue times every task and sizes
+// the next one to run for about target_seconds at that worker's measured
+// rate, capped by guided self-scheduling (a slot's share of half the
+// unassigned items) so chunks shrink as the job drains.
+//
+// A worker's capacity is its slot count, scaled by its benchmark score
+// against the average of the scores advertised. Workers without a score
+// count as average.
+//
+// Ranges lost with a failed worker go back on the queue ahead of everything
+// else and are retried a bounded number of times. Every task also carries a
+// deadline, a generous multiple of how long its worker should need for it,
+// so a hung worker is noticed even while it still answers heartbeats.
+//
+// Once nothing is left to hand out, an idle worker may run a backup copy
+// of the slowest task still in flight. A task counts as a straggler when
+// it has been running backup_factor times longer than the median time per
+// item of the tasks completed so far would predict. The first copy to
+// complete wins and the other one is withdrawn.
+//
+// Not thread safe, the reactor is its only user.
+class TaskQueue {
+private:
+    typedef std::chrono::steady_clock clock;
+
+    struct Reservation {
+        uint64_t start;
+        uint64_t end;
+        uint32_t retries;
+
+        uint64_t size() const { return end - start; }
+    };
+
+    struct InFlight {
+        Task task;
+        int worker;
+        clock::time_point started;
+    };
+
+    std::map<int, Reservation> reservations;   // Keyed by worker index
+    std::vector<Reservation> orphans;          // Left behind by departed workers, or lost
+    std::map<uint32_t, InFlight> in_flight;
+    std::map<uint32_t, uint32_t> twins;        // Both copies of a backed up task, each to the other
+    std::vector<double> item_seconds;          // Seconds per item of every task completed this job
+    std::map<int, WorkerRate> rates;
+
+    double target_seconds = 2.0;
+    double min_timeout = 30.0;                 // No task deadline is shorter than this
+    double backup_factor = 2.0;                // 0 turns backup copies off
+    uint32_t max_retries = 3;
+    uint64_t min_chunk = 1;
+    uint64_t unfinished = 0;                   // Items not yet completed
+    uint64_t departed_items = 0;               // Completed this job by workers since removed
+    uint32_t next_id = 0;
+    size_t steals = 0;
+    size_t requeues = 0;
+    size_t backups = 0;
+    uint64_t abandoned_items = 0;              // In ranges given up after max_retries
+
+    bool steal(int worker);
+    uint64_t choose_size(int worker) const;
+    double mean_score() const;
+    double capacity(int worker, double mean_score) const;
+    double total_capacity(double mean_score) const;
+    double median_item_seconds() const;
+    
+public:
+    // Splits [0, total) between the given workers by capacity
+    void reset(uint64_t total, const std::vector<int>& workers);
+
+    // Takes a range finished by an earlier run of the job out of what is
+    // left to hand out, right after reset()
+    void skip(uint64_t start, uint64_t end);
+
+    // What the worker advertised, kept until it is removed
+    void set_capacity(int worker, uint32_t slots, uint32_t score);
+
+    void set_target_seconds(double seconds) { target_seconds = seconds > 0 ? seconds : target_seconds; }
+    double get_target_seconds() const { return target_seconds; }
+    void set_min_chunk(uint64_t size) { min_chunk = size > 0 ? size : 1; }
+    void set_task_timeout(double seconds) { min_timeout = seconds > 0 ? seconds : min_timeout; }
+    void set_max_retries(uint32_t retries) { max_retries = retries; }
+    void set_backup_factor(double factor) { backup_factor = factor >= 0 ? factor : backup_factor; }
+
+    // Hands the next range for this worker, stealing if its own reservation
+    // is empty. Returns false once nothing is left to hand out.
+    bool next(int worker, Task& task);
+
+    // Starts a backup copy of the worst straggler not already backed up and
+    // not running on this worker. Only call once next() comes up empty.
+    bool speculate(int worker, Task& task);
+
+    // The other copy of a backed up task
+    bool twin_of(uint32_t task_id, uint32_t& twin) const;
+
+    // Drops one copy of a backed up task, the other keeps the range
+    void withdraw(uint32_t task_id);
+
+    // Marks the task done and folds its duration into the worker's rate.
+    // A backup copy still running is withdrawn. Returns how many seconds
+    // the task ran, negative if it was not in flight.
+    double complete(uint32_t task_id);
+
+    // The task will never complete, count its items as done
+    void abandon(uint32_t task_id);
+
+    // The task's worker failed, hand its range out again. Gives up and
+    // abandons it once the range has been retried max_retries times.
+    bool requeue(uint32_t task_id);
+
+    // The range of a task still in flight
+    bool range_of(uint32_t task_id, Task& task) const;
+
+    // A range already completed has to run again, its result was lost
+    // after the task reported done
+    void redo(uint64_t start, uint64_t end);
+
+    // Tasks that have been running past their deadline
+    std::vector<uint32_t> overdue() const;
+
+    // Releases a worker's reservation so others can pick it up
+    void remove_worker(int worker);
+
+    // Items not handed out yet
+    uint64_t unassigned() const;
+
+    // Items completed by workers this job, departed ones included
+    uint64_t items_done() const;
+
+    bool finished() const { return unfinished == 0; }
+    uint64_t remaining() const { return unfinished; }
+    size_t in_flight_count() const { return in_flight.size(); }
+    size_t steal_count() const { return steals; }
+    size_t requeue_count() const { return requeues; }
+    size_t backup_count() const { return backups; }
+    uint64_t abandoned() const { return abandoned_items; }
+    const std::map<int, WorkerRate>& worker_rates() const { return rates; }
+};
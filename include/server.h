@@ -3,50 +3,225 @@
 #include <vector>
 #include <string>
 #include <memory>
+#include <atomic>
+#include <stdint.h>
 #include <stdio.h> // Standard C File IO for simplicity
 #include <client.h>
-#include <tui.h>
+#include <protocol.h>
+#include <scheduler.h>
+#include <writer.h>
+#include <merger.h>
+#include <reducer.h>
+#include <journal.h>
+#include <range_cache.h>
+#include <events.h>
+#include <metrics.h>
 #include <pthread.h>
 
 
 constexpr int PORT = 8000;
+constexpr const char* RESULT_FILE = "out.txt";
+
+// Metrics are served on 127.0.0.1 at this port unless told otherwise, 0 turns them off
+constexpr uint16_t METRICS_PORT = 9464;
+
+// Workers are pinged this often and dropped after this long without a sound
+constexpr uint64_t HEARTBEAT_INTERVAL_MS = 1000;
+constexpr uint64_t HEARTBEAT_TIMEOUT_MS = 10000;
+
+// One row of the live worker table
+struct WorkerTelemetry {
+    int index;
+    char address[24];           // ip:port
+    const char* state;          // hello, idle, loading, running or gone
+    uint16_t slots;
+    size_t running;             // Tasks in flight
+    uint64_t range_start;       // Latest range handed out
+    uint64_t range_end;
+    uint64_t items_done;        // This job
+    double items_per_sec;       // Over all its slots
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t rtt_ms;
+    uint64_t since_heard_ms;
+    bool gone;                  // Disconnected, kept for its totals
+};
+
+// Progress of the current or last job
+struct JobTelemetry {
+    bool active = false;
+    uint64_t total = 0;
+    uint64_t done = 0;
+    uint64_t items_done = 0;    // Run by workers, including ones that left
+    double elapsed_seconds = 0;
+};
 
 class PeerServer {
 private:
     std::string hostname;
 
-    int sock_fd;
+    int sock_fd = -1;
+
+    // epoll reactor owning the listen socket and every client fd
+    int epoll_fd = -1;
+    int wake_fd = -1;
+    std::atomic<bool> running{true};
+    char* _recv_buf = nullptr;
 
     // Multithread safe
     pthread_mutex_t _clients_mutex = PTHREAD_MUTEX_INITIALIZER;
-    pthread_cond_t _clients_cond = PTHREAD_COND_INITIALIZER;
+    pthread_cond_t _done_cond = PTHREAD_COND_INITIALIZER;
     pthread_t socket_thread;
     std::vector<Client> _clients;
 
-    TUI &interface;
+    // Messages raised under the lock, passed on by the reactor after each batch
+    std::vector<std::string> _pending_status;
+    TaskQueue tasks;
+    bool job_active = false;
+    bool job_cancelled = false;     // For good, set on the way out
+    size_t failed_exits = 0;        // Ranges of this job whose script exited nonzero
+    bool results_failed = false;    // The result file could not be written, the job was given up
+    uint64_t job_started_ms = 0;
+    uint64_t job_elapsed_ms = 0;    // Frozen once the job finishes
+
+    // Task output goes through a ring of buffers to its own writer thread,
+    // merged back into item order on the way
+    ResultWriter results;
+    ResultMerger merger{results};
+
+    // With a reducer configured, output is folded instead of merged and
+    // the merger only tracks which ranges were covered
+    ResultReducer reducer;
+
+    // Reduction through an aggregation tree, off when reduce_fanin is 0.
+    // Workers in the tree fold their own output and pass partials up, so
+    // at most reduce_fanin of them send partials here directly.
+    struct AwaitedPartial {
+        uint64_t start;
+        uint64_t end;
+        size_t worker;
+    };
+    int reduce_fanin = 0;
+    bool tree_reduce = false;                   // The running job reduces through the tree
+    std::map<uint32_t, AwaitedPartial> awaiting;    // Reported DONE, partial not in yet
+    std::vector<std::pair<std::vector<uint32_t>, Partial>> deferred;   // Partials that overtook a DONE
+
+    // Progress of the running job, replayed when the same job is started
+    // again after the coordinator went down
+    Journal journal;
+    bool resume = true;
+    uint64_t journaled_items = 0;   // Reach of the last PREFIX
+
+    // Output of earlier jobs per item range, text jobs take what they can
+    // from it and only run the rest
+    RangeCache cache;
+    std::string cache_params;
+
+    // Payload fan-out through workers, off when relay_fanout is 0
+    int relay_fanout = 0;
+    int offers_outstanding = 0;
+    bool relay_planned = true;
+
+    // Memory one task needs, caps the slots of small workers. 0 if unknown.
+    uint64_t task_memory = 0;
+
+    EventSink &events;
+
+    // Scraped over HTTP from the exporter's own thread
+    ServerMetrics metrics;
+    MetricsExporter exporter{metrics};
+    uint16_t metrics_port = METRICS_PORT;
 
     int num_clients = 0;
     
-    FILE *file;
-    size_t file_size;
+    int script_fd = -1;
+    size_t file_size = 0;
+    std::string payload_digest;     // SHA-1 of the payload, the worker cache key
 
     int item_count;
+
+    void wake_reactor();
+    void post_status(const std::string& message);
+    void update_interest(size_t index);
+    void handle_accept();
+    void handle_readable(size_t index);
+    void handle_frame(size_t index, Frame& frame);
+    void handle_writable(size_t index);
+    void close_client(size_t index, const std::string& reason);
+    void join_job(size_t index);
+    void send_payload(size_t index);
+    void payload_direct(size_t index);
+    void build_relay_tree();
+    void build_aggregation_tree(const std::vector<int>& live);
+    void send_aggregate(size_t index);
+    bool accept_partial(const std::vector<uint32_t>& task_ids, const Partial& partial);
+    void retry_deferred();
+    void lose_partials(size_t index);
+    void check_finished();
+    void dispatch(size_t index);
+    uint64_t requeue_lost_cache();
+    bool check_results(bool ending = false);
+    void finish_task(size_t index, uint32_t task_id, bool completed);
+    void cancel_task(uint32_t task_id);
+    void dispatch_idle();
+    void check_health(uint64_t now);
+    void update_gauges();
+    void flush_status();
+    bool relay_status();
+    size_t live_workers();
     
 public:
-    // Laziness
-    char* _script_buf;
+    // Laziness, read-only mapping of the payload
+    const char* _script_buf = nullptr;
+    size_t get_script_size() const { return file_size; }
 
-    PeerServer(TUI &interface);
+    PeerServer(EventSink &events);
+    ~PeerServer();
 
     void set_item_count(int item_count);
     int get_item_count();
+
+    // Relay the payload through a tree of this many children per node
+    void set_relay_fanout(int fanout);
+
+    // Adaptive chunking aims for tasks of about this many seconds
+    void set_target_task_seconds(double seconds);
+
+    // No task is declared hung before running this many seconds
+    void set_task_timeout(double seconds);
+
+    // Run no more tasks on a worker than its memory holds at this many bytes each
+    void set_task_memory(uint64_t bytes);
+
+    // Back up tasks running this many times longer than the median predicts, 0 disables
+    void set_backup_factor(double factor);
+
+    // Loopback port of the metrics endpoint, 0 disables it. Takes effect on start().
+    void set_metrics_port(uint16_t port);
+
+    // Fold typed result records with op instead of writing output as text,
+    // k is the size of a TOPK result
+    void set_reduce(ReduceOp op, size_t k);
+
+    // Reduce through a tree of workers where no node, the coordinator
+    // included, takes partials from more than fanin children. 0 disables.
+    void set_reduce_fanin(int fanin);
+
+    // Whether a job picks up the journal of an interrupted run of itself
+    void set_resume(bool resume);
+
+    // Budget of the result cache, 0 disables it
+    void set_result_cache(uint64_t bytes);
+
+    // Whatever else the output depends on, cached output of other params is not reused
+    void set_cache_params(const std::string& params);
+    std::string scheduler_summary();
         
-    void addFile(std::string& file_name);
+    bool addFile(std::string& file_name);
 
-    // Methods to expose client list and synchronization primitives
-    pthread_mutex_t* get_clients_mutex() { return &_clients_mutex; }
-    pthread_cond_t* get_clients_cond() { return &_clients_cond; }
-    std::vector<Client>* get_clients() { return &_clients; }
+    // Snapshot for the worker table, fills workers in place so a caller
+    // polling every frame reuses its rows
+    void telemetry(std::vector<WorkerTelemetry>& workers, JobTelemetry& job);
 
     static void *socket_thread_fn(void *v) {
         PeerServer* app = static_cast<PeerServer*>(v);
@@ -58,6 +233,21 @@ public:
     int send_files();
     int recv_output();
 
-    void run();
+    // Gives up on the running job and refuses later ones, recv_output()
+    // returns soon after. The journal is left open-ended, so the job
+    // resumes on the next run.
+    void cancel_job();
+
+    // Runs the reactor on its own thread until stop()
+    void start();
+    void stop();
+
+    // Without a terminal: waits up to wait_seconds for min_workers to say
+    // HELLO, runs one job and returns an exit status. 0 when every item
+    // produced output, 1 when the job could not run, lost every worker or
+    // could not write its results,
+    // 2 when some items have no output, were given up on or ran in a
+    // script that exited nonzero.
+    int run_headless(size_t min_workers, double wait_seconds);
 
 };
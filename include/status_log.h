@@ -0,0 +1,61 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+constexpr size_t STATUS_TEXT_SIZE = 200;
+constexpr size_t STATUS_LOG_SIZE = 1024;
+
+// One status message. Plain bytes so it is copied, never allocated, on
+// its way from the thread that raised it to the screen. Longer messages
+// are cut short on screen; what is past the cut rides along in tail, the
+// one allocation, for the log file. Whoever takes the record off the
+// queue owns tail.
+struct StatusRecord {
+    time_t when;
+    uint16_t len;
+    char text[STATUS_TEXT_SIZE];
+    std::string* tail = nullptr;
+
+    void set(const std::string& message) {
+        time(&when);
+        len = static_cast<uint16_t>(message.size() < STATUS_TEXT_SIZE ? message.size() : STATUS_TEXT_SIZE);
+        memcpy(text, message.data(), len);
+    }
+
+    // "[HH:MM:SS]", formatted only when a record is shown
+    void format_time(char* out, size_t size) const {
+        struct tm local;
+        localtime_r(&when, &local);
+        strftime(out, size, "[%H:%M:%S]", &local);
+    }
+};
+
+// The most recent records in a preallocated ring, oldest overwritten first
+class StatusLog {
+private:
+    std::vector<StatusRecord> records;
+    size_t head = 0;        // Oldest record
+    size_t count = 0;
+
+public:
+    explicit StatusLog(size_t capacity = STATUS_LOG_SIZE) : records(capacity) {}
+
+    void push(const StatusRecord& record) {
+        records[(head + count) % records.size()] = record;
+        if (count < records.size()) {
+            count++;
+        } else {
+            head = (head + 1) % records.size();
+        }
+    }
+
+    size_t size() const { return count; }
+
+    // 0 is the oldest record kept
+    const StatusRecord& at(size_t index) const { return records[(head + index) % records.size()]; }
+};
@@ -5,27 +5,44 @@
 #include <vector>
 #include <string>
 #include <pthread.h>
+#include <atomic>
+#include <events.h>
+#include <event_queue.h>
+#include <status_log.h>
+#include <server.h>
+#include <stdio.h>
 
-// Forward declaration
-class PeerServer;
-class Client;
+// Frames per second of the render thread
+constexpr int RENDER_FPS = 20;
 
-class TUI {
+// Status messages that may wait for the next frame, more are dropped from
+// the screen but still logged
+constexpr size_t STATUS_QUEUE_SIZE = 4096;
+
+// Every status message of the session, the screen only keeps the latest
+constexpr const char* STATUS_LOG_FILE = "peerpulse.log";
+
+// The worker table is refreshed from the server every this many frames
+constexpr int TELEMETRY_INTERVAL_FRAMES = 5;
+
+// Producers never touch the terminal. Status messages go into a lock-free
+// queue and other changes only mark a region dirty; a render thread drains
+// the queue at a fixed frame rate and redraws just the dirty windows.
+class TUI : public EventSink {
 public:
     TUI();
     ~TUI();
     
     void run();
     
-    // Add a new client to the TUI's client list
-    void add_client(const std::string& client_info);
-    
-    // Add a message to the status window
-    void add_status_message(const std::string& message);
+    // Queue a message for the status window and the log, never waits for the screen
+    void add_status_message(const std::string& message) override;
+
+    // Replace the chunk size line shown above the status messages
+    void set_scheduler_summary(const std::string& summary) override;
     
-    // Set the server reference for client monitoring
-    void set_server_ref(PeerServer* server, pthread_mutex_t* clients_mutex, 
-                      pthread_cond_t* clients_cond, std::vector<Client>* clients);
+    // The server whose workers and job are shown
+    void set_server_ref(PeerServer* server);
     
     bool in_main = false;
     
@@ -33,17 +50,42 @@ private:
     // Window and panel pointers
     WINDOW* intro_win_;
     WINDOW* main_win_;
-    WINDOW* client_win_;
+    WINDOW* workers_win_;
     WINDOW* status_win_;
     PANEL* intro_panel_;
     PANEL* main_panel_;
     
-    // Client data
-    std::vector<std::string> clients_;
+    // Worker table, refreshed and drawn only by the render thread
+    std::vector<WorkerTelemetry> workers_;
+    JobTelemetry job_;
     std::string socket_address_;
     
-    // Status messages for the right panel
-    std::vector<std::string> status_messages_;
+    // Status messages for the right panel, only the render thread touches
+    // status_log_ and log_file_. Records the full queue refuses wait in
+    // overflow_status_ for the log, newer ones follow them there until the
+    // render thread has caught up, so the log stays in order.
+    EventQueue<StatusRecord> pending_status_{STATUS_QUEUE_SIZE};
+    std::atomic<size_t> dropped_status_{0};
+    std::atomic<bool> overflowing_{false};
+    std::vector<StatusRecord> overflow_status_;
+    pthread_mutex_t overflow_mutex = PTHREAD_MUTEX_INITIALIZER;
+    StatusLog status_log_;
+    FILE* log_file_ = nullptr;
+    std::string scheduler_summary_;
+
+    // Regions to redraw on the next frame
+    std::atomic<bool> dirty_layout_{false};
+    std::atomic<bool> dirty_workers_{false};
+    std::atomic<bool> dirty_summary_{false};
+
+    std::atomic<bool> rendering_{false};
+    pthread_t render_thread_;
+
+    // The job runs on its own thread so input stays live. Joined before the
+    // next job starts and on quit, only the input thread touches job_joinable_.
+    std::atomic<bool> job_running_{false};
+    bool job_joinable_ = false;
+    pthread_t job_thread_;
     
     // Dimensions
     int term_height_;
@@ -51,17 +93,9 @@ private:
     
     // Thread synchronization
     pthread_mutex_t ncurses_mutex = PTHREAD_MUTEX_INITIALIZER;
-    pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_t summary_mutex = PTHREAD_MUTEX_INITIALIZER;
     
-    // Server references for client checking
     PeerServer* server_ref = nullptr;
-    pthread_mutex_t* server_clients_mutex = nullptr;
-    pthread_cond_t* server_clients_cond = nullptr;
-    std::vector<Client>* server_clients = nullptr;
-    size_t last_client_count = 0;
-    
-    // Method to check for new clients on demand
-    void check_for_new_clients();
     
     // Private methods
     void init_ncurses();
@@ -70,8 +104,26 @@ private:
     void destroy_intro_screen();
     void render_intro_screen();
     void render_main_interface();
+    void draw_workers();
+    void draw_status();
+    void render_loop();
+    bool drain_status();
+    void log_status(StatusRecord& record);
     void handle_input();
     void show_script_viewer();
+    void show_log_viewer();
 
     void distribute_network();
+
+    static void *render_thread_fn(void *v) {
+        static_cast<TUI*>(v)->render_loop();
+        return NULL;
+    }
+
+    static void *job_thread_fn(void *v) {
+        TUI* tui = static_cast<TUI*>(v);
+        tui->distribute_network();
+        tui->job_running_ = false;
+        return NULL;
+    }
 };
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <deque>
+#include <stdint.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <client.h>
+#include <protocol.h>
+#include <reducer.h>
+
+constexpr size_t WORKER_CHUNK_SIZE = 256 * 1024;
+
+// Folded output goes up the aggregation tree at most this often
+constexpr int AGGREGATE_FLUSH_MS = 100;
+constexpr double BENCHMARK_MS = 250;
+
+struct WorkerConfig {
+    std::string host;
+    int port = 8000;
+    std::string python = "python3";
+    std::string cache_dir;          // Defaults to ~/.cache/peerpulse/payloads
+    uint64_t cache_bytes = 1ull << 30;
+    int slots = 0;                  // Tasks run at once, defaults to the online cores
+    bool benchmark = false;         // Measure a score to advertise in HELLO
+    bool warm = false;              // Run tasks in long-lived runners instead of a process each
+};
+
+// A task process and the pipe its stdout is streamed back through
+struct RunningTask {
+    uint32_t id;
+    pid_t pid;
+    int out_fd;
+    uint64_t bytes_sent;
+};
+
+// A long-lived interpreter with the payload already compiled. Ranges go
+// in over one pipe as text lines, output and end-of-task records come
+// back over another, see RUNNER_SOURCE in runner.cpp. pid is -1 while the
+// slot has no runner.
+struct WarmRunner {
+    pid_t pid = -1;
+    int in_fd = -1;
+    int out_fd = -1;
+    std::string script;             // Payload it has loaded
+    std::string pending;            // Output not yet parsed into records
+    bool busy = false;
+    uint32_t task_id = 0;
+    uint64_t bytes_sent = 0;
+};
+
+// Native worker agent. Speaks the same framed protocol as
+// scripts/client_connect.py: caches payloads by hash, relays them down the
+// fan-out tree, runs each range as a child process and streams its stdout
+// back while it runs. Runs up to one task per core at a time.
+class PeerWorker {
+private:
+    WorkerConfig config;
+    Client conn;
+
+    // Relay listener for payloads pushed by peers
+    int relay_fd = -1;
+    uint16_t relay_port = 0;
+    pthread_t relay_thread;
+
+    // Shared with relay threads
+    pthread_mutex_t state_mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_t send_mutex = PTHREAD_MUTEX_INITIALIZER;
+    std::string offered;            // Digest from the last PAYLOAD_OFFER
+    std::string script_path;        // Cached payload for the offered digest
+
+    RelayPlan plan;                 // Set by RELAY, used by the next SCRIPT
+    bool have_plan = false;
+
+    std::vector<RunningTask> running;
+    std::vector<WarmRunner> runners;    // One per slot in warm mode
+    std::deque<TaskRange> waiting;
+    char* io_buf;                   // Preallocated, reused for every read
+
+    // Tree reduction, set by AGGREGATE. Output of our own tasks and the
+    // partials children send to the relay listener fold into one reducer.
+    // aggregating is only changed by the main thread, under the mutex.
+    pthread_mutex_t aggregate_mutex = PTHREAD_MUTEX_INITIALIZER;
+    bool aggregating = false;
+    ResultReducer reducer;
+    std::vector<uint32_t> folded;   // Tasks the reducer's total covers
+    Endpoint parent = {0, 0};       // Port 0 sends partials to the coordinator
+    Client upstream;                // Connection to the parent aggregator
+    Endpoint upstream_to = {0, 0};
+    uint64_t last_flush_ms = 0;
+
+    bool send_control(MsgType type, const std::string& payload);
+    bool send_done(TaskDone done);
+    void fold_output(uint32_t task_id, const char* data, size_t len);
+    bool flush_partials(bool force);
+    void set_aggregate(const AggregatePlan& plan);
+    bool start_relay_listener();
+    void relay_loop();
+    void serve_peer(int fd);
+
+    std::string cache_path(const std::string& digest);
+    std::string cache_lookup(const std::string& digest);
+    void cache_trim(const std::string& keep);
+    std::string receive_payload(Client& source, uint32_t length, const RelayPlan* relay);
+
+    bool handle_frame(Frame& frame);
+    bool start_task(const TaskRange& range);
+    bool pump_task(size_t slot);
+    void cancel_task(uint32_t task_id);
+
+    // Warm mode, implemented in runner.cpp
+    bool spawn_runner(WarmRunner& runner, const std::string& script);
+    void stop_runner(WarmRunner& runner);
+    bool start_warm(const TaskRange& range, const std::string& script);
+    bool pump_runner(size_t slot);
+    bool send_output(uint32_t task_id, const char* data, size_t len);
+    void start_waiting();
+
+    static void *relay_thread_fn(void *v) {
+        static_cast<PeerWorker*>(v)->relay_loop();
+        return NULL;
+    }
+
+    struct PeerArgs {
+        PeerWorker* worker;
+        int fd;
+    };
+
+    static void *peer_thread_fn(void *v) {
+        PeerArgs* args = static_cast<PeerArgs*>(v);
+        args->worker->serve_peer(args->fd);
+        delete args;
+        return NULL;
+    }
+
+public:
+    PeerWorker(const WorkerConfig& config);
+    ~PeerWorker();
+
+    // Connects and serves the coordinator until it hangs up
+    int run();
+};
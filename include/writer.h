@@ -0,0 +1,70 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+constexpr size_t WRITER_SLOT_SIZE = 256 * 1024;
+constexpr size_t WRITER_SLOTS = 32;
+
+// Appends result output to one file from a dedicated thread. Callers copy
+// into a bounded ring of buffers and return straight away; the writer
+// thread drains every filled slot with a single writev and keeps the file
+// open, so disk writes never sit on the network path. A caller only blocks
+// when the whole ring is full and the disk is behind. After a failed write
+// nothing more reaches the file, so it always ends on output written in
+// order, and error() tells the caller.
+class ResultWriter {
+private:
+    struct Slot {
+        std::vector<char> data;
+        size_t len = 0;
+    };
+
+    std::vector<Slot> slots;
+    size_t head = 0;        // Oldest slot holding data
+    size_t used = 0;        // Slots holding data, the last one may still be filling
+    size_t writing = 0;     // Slots from head owned by the writer thread
+    bool stopping = false;
+    int failed_errno = 0;   // First write error, later data is dropped
+
+    int fd = -1;
+    pthread_t thread;
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t data_cond = PTHREAD_COND_INITIALIZER;
+    pthread_cond_t space_cond = PTHREAD_COND_INITIALIZER;
+
+    void write_loop();
+    bool write_all(size_t first, size_t count);
+
+    static void *writer_thread_fn(void *v) {
+        static_cast<ResultWriter*>(v)->write_loop();
+        return NULL;
+    }
+
+public:
+    ResultWriter(size_t slot_count = WRITER_SLOTS, size_t slot_size = WRITER_SLOT_SIZE);
+    ~ResultWriter();
+
+    // Opens the file for appending and starts the writer thread
+    bool open(const std::string& path);
+    bool is_open() const { return fd >= 0; }
+
+    // Copies the bytes into the ring, waits only while the ring is full
+    void write(const char* data, size_t len);
+
+    // Blocks until everything written so far has reached the file
+    void flush();
+
+    // Flushes, then cuts the file to size bytes, empty for a fresh job or
+    // the output a resumed job already has. Clears an earlier error.
+    bool truncate(uint64_t size = 0);
+
+    // errno of the first write that failed since open() or truncate(), 0 if none
+    int error();
+
+    // Drains the ring, stops the thread and closes the file
+    void close();
+};
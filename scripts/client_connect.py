@@ -4,9 +4,38 @@ import os
 import subprocess
 import struct
 import time
+import hashlib
+import threading
+import selectors
+from collections import deque
 
 PAGE_SIZE = 4096
 
+# Framed wire protocol, see include/protocol.h
+HEADER = struct.Struct("!IB")
+MSG_SCRIPT = 1
+MSG_TASK_RANGE = 2
+MSG_RESULT_CHUNK = 3
+MSG_DONE = 4
+MSG_HEARTBEAT = 5
+MSG_PAYLOAD_OFFER = 6
+MSG_PAYLOAD_STATUS = 7
+MSG_HELLO = 8
+MSG_RELAY = 9
+MSG_RELAY_FAILED = 10
+MSG_CANCEL = 11
+
+RESULT_CHUNK_SIZE = 64 * 1024
+RELAY_CHUNK_SIZE = 256 * 1024
+
+# The control socket is shared with relay threads
+send_lock = threading.Lock()
+
+# Payloads are cached on disk under their SHA-1, least recently used first out
+CACHE_DIR = os.environ.get("PEERPULSE_CACHE_DIR",
+                           os.path.join(os.path.expanduser("~"), ".cache", "peerpulse", "payloads"))
+CACHE_MAX_BYTES = int(os.environ.get("PEERPULSE_CACHE_BYTES", str(1 << 30)))
+
 def get_server_address():
     """Prompt user for server address and port"""
     server = "100.110.118.91"
@@ -23,6 +52,233 @@ def send_all(sock, data):
         total_sent += sent
     return total_sent
 
+def recv_exact(sock, size):
+    """Receive exactly size bytes into a preallocated buffer"""
+    buf = bytearray(size)
+    view = memoryview(buf)
+    received = 0
+    while received < size:
+        n = sock.recv_into(view[received:], size - received)
+        if n == 0:
+            raise ConnectionError("Server closed the connection")
+        received += n
+    return bytes(buf)
+
+def recv_header(sock):
+    length, msg_type = HEADER.unpack(recv_exact(sock, HEADER.size))
+    return msg_type, length
+
+def recv_frame(sock):
+    msg_type, length = recv_header(sock)
+    return msg_type, recv_exact(sock, length)
+
+def send_frame(sock, msg_type, payload=b""):
+    with send_lock:
+        send_all(sock, HEADER.pack(len(payload), msg_type) + payload)
+
+def relay_subtree(pos, count, fanout):
+    """Breadth-first heap positions below pos, see RelayPlan in protocol.h"""
+    subtree = []
+    first = last = pos
+    while True:
+        first = fanout * first + 1
+        last = fanout * last + fanout
+        if first > count:
+            return subtree
+        subtree.extend(range(first, min(last, count) + 1))
+
+def encode_endpoints(endpoints):
+    return struct.pack("!I", len(endpoints)) + b"".join(
+        socket.inet_aton(host) + struct.pack("!H", port) for host, port in endpoints)
+
+def decode_relay_plan(payload):
+    fanout, count = struct.unpack("!BI", payload[:5])
+    endpoints = []
+    for offset in range(5, 5 + 6 * count, 6):
+        host = socket.inet_ntoa(payload[offset:offset + 4])
+        port, = struct.unpack("!H", payload[offset + 4:offset + 6])
+        endpoints.append((host, port))
+    return fanout, endpoints
+
+def receive_payload(sock, length, plan, control):
+    """Read a SCRIPT payload, forwarding each chunk down the relay tree as it arrives"""
+    children = []
+    failed = []
+    if plan:
+        fanout, descendants = plan
+        for pos in range(1, min(fanout, len(descendants)) + 1):
+            subtree = [descendants[p - 1] for p in relay_subtree(pos, len(descendants), fanout)]
+            try:
+                peer = socket.create_connection(descendants[pos - 1], timeout=10)
+                peer.settimeout(None)
+                if subtree:
+                    peer.sendall(HEADER.pack(5 + 6 * len(subtree), MSG_RELAY) +
+                                 struct.pack("!B", fanout) + encode_endpoints(subtree))
+                peer.sendall(HEADER.pack(length, MSG_SCRIPT))
+                children.append((peer, [descendants[pos - 1]] + subtree))
+            except OSError as e:
+                print(f"Relay to {descendants[pos - 1]} failed: {e}")
+                failed += [descendants[pos - 1]] + subtree
+
+    buf = bytearray(length)
+    view = memoryview(buf)
+    received = 0
+    while received < length:
+        n = sock.recv_into(view[received:], min(RELAY_CHUNK_SIZE, length - received))
+        if n == 0:
+            raise ConnectionError("Payload sender closed the connection")
+        for child in list(children):
+            try:
+                child[0].sendall(view[received:received + n])
+            except OSError as e:
+                print(f"Relay to {child[1][0]} failed: {e}")
+                children.remove(child)
+                failed += child[1]
+                child[0].close()
+        received += n
+
+    for peer, _ in children:
+        peer.close()
+    if failed:
+        send_frame(control, MSG_RELAY_FAILED, encode_endpoints(failed))
+    return bytes(buf)
+
+def cache_path(digest):
+    return os.path.join(CACHE_DIR, digest.hex() + ".py")
+
+def cache_lookup(digest):
+    """Return the cached payload path and mark it recently used, or None"""
+    path = cache_path(digest)
+    try:
+        os.utime(path)
+        return path
+    except OSError:
+        return None
+
+def cache_store(digest, payload):
+    """Store a payload under its hash and trim the cache to its size bound"""
+    if hashlib.sha1(payload).digest() != digest:
+        raise ValueError("Payload does not match the offered hash")
+
+    os.makedirs(CACHE_DIR, exist_ok=True)
+    path = cache_path(digest)
+    with tempfile.NamedTemporaryFile(mode='w+b', dir=CACHE_DIR, delete=False) as temp_file:
+        temp_file.write(payload)
+    os.replace(temp_file.name, path)
+
+    entries = []
+    for name in os.listdir(CACHE_DIR):
+        entry = os.path.join(CACHE_DIR, name)
+        try:
+            st = os.stat(entry)
+        except OSError:
+            continue
+        entries.append((st.st_mtime, st.st_size, entry))
+    total = sum(size for _, size, _ in entries)
+    for _, size, entry in sorted(entries):
+        if total <= CACHE_MAX_BYTES:
+            break
+        if entry != path:
+            os.unlink(entry)
+            total -= size
+    return path
+
+class RelayState:
+    """Payload offered by the coordinator, shared with the relay listener"""
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.offered = None
+        self.script_path = None
+
+def serve_peer(conn, control, state):
+    """Receive the payload from a parent in the relay tree"""
+    try:
+        plan = None
+        while True:
+            msg_type, length = recv_header(conn)
+            if msg_type == MSG_RELAY:
+                plan = decode_relay_plan(recv_exact(conn, length))
+            elif msg_type == MSG_SCRIPT:
+                payload = receive_payload(conn, length, plan, control)
+                break
+            else:
+                raise ValueError(f"Unexpected relay message type {msg_type}")
+
+        with state.lock:
+            state.script_path = cache_store(state.offered, payload)
+            digest = state.offered
+        print(f"Received {length} byte script from a peer")
+        send_frame(control, MSG_PAYLOAD_STATUS, digest + bytes([1]))
+    except Exception as e:
+        print(f"Relay receive failed: {e}")
+    finally:
+        conn.close()
+
+def relay_listener(listener, control, state):
+    while True:
+        conn, _ = listener.accept()
+        threading.Thread(target=serve_peer, args=(conn, control, state), daemon=True).start()
+
+def run_task(client, script_path, task_id, lower, upper, deferred):
+    """Run the script over [lower, upper), streaming its output back as it is produced"""
+    env = os.environ.copy()
+    env.update({
+        'PROCESS_BOUND_LOWER': str(lower),
+        'PROCESS_BOUND_UPPER': str(upper)
+    })
+
+    print(f"\nExecuting task {task_id} over [{lower}, {upper})...")
+    proc = subprocess.Popen(['python3', script_path], env=env, stdout=subprocess.PIPE)
+
+    # Keep answering the server while the task runs, anything else waits
+    sel = selectors.DefaultSelector()
+    sel.register(proc.stdout, selectors.EVENT_READ)
+    sel.register(client, selectors.EVENT_READ)
+
+    tag = struct.pack("!I", task_id)
+    sent = 0
+    running = True
+    cancelled = False
+    while running:
+        for key, _ in sel.select():
+            if key.fileobj is client:
+                msg_type, payload = recv_frame(client)
+                if msg_type == MSG_HEARTBEAT:
+                    send_frame(client, MSG_HEARTBEAT, payload)
+                elif msg_type == MSG_CANCEL:
+                    if payload == tag:
+                        cancelled = True
+                        running = False
+                        break
+                else:
+                    deferred.append((msg_type, payload))
+                continue
+
+            chunk = os.read(proc.stdout.fileno(), RESULT_CHUNK_SIZE)
+            if not chunk:
+                running = False
+                break
+            send_frame(client, MSG_RESULT_CHUNK, tag + chunk)
+            sent += len(chunk)
+
+    sel.close()
+    if cancelled:
+        # Another worker finished the range first, the server expects no DONE
+        proc.kill()
+        proc.stdout.close()
+        proc.wait()
+        print(f"Task {task_id} cancelled after {sent} bytes")
+        return
+
+    proc.stdout.close()
+    status = proc.wait()
+    if status != 0:
+        print(f"\nScript failed with return code {status}")
+
+    # End-of-task marker carries the byte count so the server can spot truncation
+    print(f"Task {task_id} sent {sent} bytes")
+    send_frame(client, MSG_DONE, struct.pack("!IiQ", task_id, status, sent))
+
 def main():
     # Get server address from user
     ADDR = get_server_address()
@@ -31,107 +287,74 @@ def main():
     # Create socket and connect
     client = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
     client.setsockopt(socket.SOL_SOCKET, socket.SO_SNDBUF, 16777216)  # 16MB buffer
+    client.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    state = RelayState()
+    plan = None
+    deferred = deque()
     try:
         client.connect(ADDR)
         print("Connected to server")
 
-        # Receive data from server
-        print("Waiting for data from server...")
-        received_data = client.recv(PAGE_SIZE * 2)  # Adjust buffer size as needed
-        
-        if not received_data:
-            print("No data received from server")
-            return
-
-        # Keep receiving until no more data or a reasonable timeout
-        all_data = received_data
-        client.settimeout(0.5)  # Set a short timeout for additional data
-        try:
-            while True:
-                try:
-                    chunk = client.recv(PAGE_SIZE)
-                    if not chunk:
-                        break
-                    all_data += chunk
-                    print(f"Received additional {len(chunk)} bytes...")
-                except socket.timeout:
-                    break
-        except:
-            pass
-        
-        client.settimeout(None)  # Reset timeout
-        print(f"Total received: {len(all_data)} bytes")
-
-        # Get the bounds values
+        # Peers push relayed payloads to this listener
+        listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        listener.bind(("0.0.0.0", 0))
+        listener.listen(16)
+        threading.Thread(target=relay_listener, args=(listener, client, state), daemon=True).start()
+        # Tasks run one at a time here, so a single slot whatever the core count
         try:
-            val2 = [int(x) for x in str(client.recv(15).decode("ascii")).split(" ")]
-            print(f"Received bounds: {val2}")
-        except Exception as e:
-            print(f"Error parsing bounds: {e}")
-            return
-
-        # Create temp file
-        with tempfile.NamedTemporaryFile(mode='w+b', suffix='.py', delete=False) as temp_file:
-            temp_file.write(all_data)
-            temp_file_path = temp_file.name
-            print(f"Created temp file: {temp_file_path}")
-
-        # Prepare environment variables
-        env = os.environ.copy()
-        env.update({
-            'PROCESS_BOUND_LOWER': str(val2[0]),
-            'PROCESS_BOUND_UPPER': str(val2[1])
-        })
-
-        # Run the script as subprocess
-        try:
-            print("\nExecuting received script...")
-            result = subprocess.run(
-                ['python3', temp_file_path],
-                env=env,
-                capture_output=True,
-                text=True,
-                check=True
-            )
-            
-            print("\nScript output:")
-            print(result.stdout)
-
-            # Send the output back to the server
-            output_data = result.stdout.encode('ascii')
-            print(f"Sending {len(output_data)} bytes back to server...")
-            
-            # Use our send_all helper to ensure all data is sent
-            bytes_sent = send_all(client, output_data)
-            print(f"Successfully sent {bytes_sent} bytes")
-            
-            # Sleep a bit to ensure the server receives everything
-            time.sleep(0.5)
-
-        except subprocess.CalledProcessError as e:
-            print(f"\nScript failed with error: {e}")
-            print(f"Return code: {e.returncode}")
-            print(f"Output: {e.stdout}")
-            print(f"Errors: {e.stderr}")
-        finally:
-            # Clean up temp file
-            try:
-                os.unlink(temp_file_path)
-                print(f"\nRemoved temp file: {temp_file_path}")
-            except OSError as e:
-                print(f"\nError removing temp file: {e}")
+            memory = os.sysconf("SC_PHYS_PAGES") * os.sysconf("SC_PAGE_SIZE")
+        except (ValueError, OSError):
+            memory = 0
+        send_frame(client, MSG_HELLO, struct.pack("!HHQI", listener.getsockname()[1], 1, memory, 0))
+
+        # Serve frames until the server hangs up
+        while True:
+            if deferred:
+                msg_type, payload = deferred.popleft()
+            else:
+                msg_type, length = recv_header(client)
+                if msg_type == MSG_SCRIPT:
+                    payload = receive_payload(client, length, plan, client)
+                    plan = None
+                else:
+                    payload = recv_exact(client, length)
+
+            if msg_type == MSG_SCRIPT:
+                with state.lock:
+                    state.script_path = cache_store(state.offered, payload)
+                print(f"Received {len(payload)} byte script into {state.script_path}")
+            elif msg_type == MSG_PAYLOAD_OFFER:
+                with state.lock:
+                    state.offered = payload[:20]
+                    state.script_path = cache_lookup(state.offered)
+                    cached = state.script_path is not None
+                if cached:
+                    print(f"Payload {payload[:20].hex()[:12]} found in cache")
+                send_frame(client, MSG_PAYLOAD_STATUS, payload[:20] + bytes([1 if cached else 0]))
+            elif msg_type == MSG_RELAY:
+                plan = decode_relay_plan(payload)
+            elif msg_type == MSG_TASK_RANGE:
+                task_id, lower, upper = struct.unpack("!IQQ", payload)
+                with state.lock:
+                    script_path = state.script_path
+                if not script_path:
+                    print("Task received before any script")
+                    send_frame(client, MSG_DONE, struct.pack("!IiQ", task_id, -1, 0))
+                    continue
+                run_task(client, script_path, task_id, lower, upper, deferred)
+            elif msg_type == MSG_HEARTBEAT:
+                send_frame(client, MSG_HEARTBEAT, payload)
+            elif msg_type == MSG_CANCEL:
+                pass  # The task already finished
+            else:
+                print(f"Ignoring unknown message type {msg_type}")
+    except ConnectionError as e:
+        print(f"Disconnected: {e}")
     except Exception as e:
         print(f"Error: {e}")
     finally:
-        # Close the socket properly
-        try:
-            # Shutdown the socket to indicate we're done sending
-            client.shutdown(socket.SHUT_WR)
-            time.sleep(0.5)  # Wait for server to process
-            client.close()
-            print("Socket closed")
-        except:
-            pass
+        client.close()
+        print("Socket closed")
 
 if __name__ == "__main__":
     main()
@@ -0,0 +1,25 @@
+import os
+import struct
+import sys
+
+# Example payload for a reduced job (--reduce=...). Instead of text, every
+# item writes one binary record to stdout: a uint64 key and a float64
+# value, big-endian, which the coordinator folds as it arrives.
+RECORD = struct.Struct("!Qd")
+
+def score(item):
+    """Some per-item number worth summing, ranking or binning"""
+    return ((item * 2654435761) % 1000) / 10.0
+
+def main():
+    lower = int(os.getenv('PROCESS_BOUND_LOWER', 0))
+    upper = int(os.getenv('PROCESS_BOUND_UPPER', 1000))
+
+    out = sys.stdout.buffer
+    for item in range(lower, upper):
+        # Keyed by item, a histogram payload would key by bin instead
+        out.write(RECORD.pack(item, score(item)))
+    out.flush()
+
+if __name__ == "__main__":
+    main()
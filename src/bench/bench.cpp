@@ -0,0 +1,535 @@
+#include <iostream>
+#include <algorithm>
+#include <queue>
+#include <tuple>
+#include <random>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <signal.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <protocol.h>
+#include <server.h>
+
+// End-to-end benchmark: starts the coordinator headless on loopback and
+// drives it with fake workers that speak the real protocol but only
+// pretend to compute. One epoll loop plays every worker, so a thousand of
+// them cost the benchmark little and the numbers are the coordinator's.
+
+constexpr size_t BENCH_CHUNK_SIZE = 64 * 1024;
+constexpr int BENCH_MAX_EVENTS = 256;
+
+// How long to keep trying to reach a coordinator that is still starting
+constexpr uint64_t CONNECT_TIMEOUT_US = 5000000;
+
+struct BenchConfig {
+    std::string coordinator;                    // PeerPulse binary
+    std::vector<int> scale = {1, 10, 100, 1000};
+    uint64_t items = 10000;
+    double item_ms = 0.2;                       // Pretend compute time per item
+    size_t output_bytes = 64;                   // Output per item, newline included
+    double failure_rate = 0;                    // Share of tasks reported with short output
+    double task_seconds = 0;                    // Passed to the coordinator if set
+    unsigned seed = 1;
+};
+
+struct FakeWorker {
+    int fd = -1;
+    FrameReader reader;
+    std::string out;
+    size_t out_off = 0;
+    bool want_write = false;
+
+    bool busy = false;
+    TaskRange task;
+    uint64_t done_sent_us = 0;      // Waiting for the next range since then, 0 if not
+};
+
+struct RunResult {
+    int workers;
+    int exit_status;
+    double makespan;                // First range handed out to coordinator exit
+    double cpu_seconds;             // Coordinator user plus system time
+    std::vector<double> dispatch_ms;
+    uint64_t result_bytes;          // Output the workers sent
+    uint64_t tasks;
+    uint64_t failed;
+};
+
+static uint64_t monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+class Bench {
+private:
+    const BenchConfig& config;
+    std::string dir;
+    std::vector<FakeWorker> workers;
+    int epoll_fd = -1;
+    std::mt19937 random;
+
+    // Tasks finishing next: due time, worker index, task id
+    typedef std::tuple<uint64_t, size_t, uint32_t> Due;
+    std::priority_queue<Due, std::vector<Due>, std::greater<Due>> timers;
+
+    RunResult result;
+    uint64_t first_task_us = 0;
+
+    pid_t launch(int count);
+    bool connect_all(int count);
+    void queue_frame(size_t index, MsgType type, const std::string& payload);
+    bool flush(size_t index);
+    void handle_frame(size_t index, Frame& frame);
+    void finish_task(size_t index, uint32_t task_id);
+    void drop(size_t index);
+
+public:
+    Bench(const BenchConfig& config, const std::string& dir) : config(config), dir(dir), random(config.seed) {}
+
+    bool run(int count, RunResult& out);
+};
+
+pid_t Bench::launch(int count) {
+    std::string items = std::to_string(config.items);
+    std::string wanted = "--workers=" + std::to_string(count);
+    std::string task_seconds = "--task-seconds=" + std::to_string(config.task_seconds);
+
+    // Every row runs the whole job: nothing from the result cache or the
+    // journal of an earlier row, and nothing left in the user's cache
+    std::vector<const char*> argv = {config.coordinator.c_str(), "payload.py", items.c_str(), "--headless",
+                                     wanted.c_str(), "--wait=60", "--metrics-port=0", "--result-cache=0",
+                                     "--fresh"};
+    if (config.task_seconds > 0) {
+        argv.push_back(task_seconds.c_str());
+    }
+    argv.push_back(nullptr);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Its progress lines go to a log next to its out.txt
+        if (chdir(dir.c_str()) < 0) {
+            _exit(127);
+        }
+        int log = open("coordinator.log", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (log < 0) {
+            _exit(127);
+        }
+        dup2(log, STDOUT_FILENO);
+        dup2(log, STDERR_FILENO);
+        execv(argv[0], const_cast<char* const*>(argv.data()));
+        _exit(127);
+    }
+    return pid;
+}
+
+bool Bench::connect_all(int count) {
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(PORT);
+
+    uint64_t deadline = monotonic_us() + CONNECT_TIMEOUT_US;
+    workers.assign(count, FakeWorker());
+
+    for (int i = 0; i < count; i++) {
+        FakeWorker& w = workers[i];
+        while (1) {
+            w.fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (w.fd < 0) {
+                perror("socket");
+                return false;
+            }
+            if (connect(w.fd, (struct sockaddr*)&address, sizeof(address)) == 0) {
+                break;
+            }
+            close(w.fd);
+            w.fd = -1;
+            if (monotonic_us() > deadline) {
+                fprintf(stderr, "Could not reach the coordinator on port %d\n", PORT);
+                return false;
+            }
+            usleep(20000);
+        }
+
+        int opt = 1;
+        setsockopt(w.fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        fcntl(w.fd, F_SETFL, O_NONBLOCK);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.u64 = i;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, w.fd, &ev);
+
+        // One slot each, no relay and no benchmark score
+        Hello hello;
+        hello.relay_port = 0;
+        queue_frame(i, MsgType::HELLO, encode_hello(hello));
+        flush(i);
+    }
+    return true;
+}
+
+void Bench::queue_frame(size_t index, MsgType type, const std::string& payload) {
+    std::string& out = workers[index].out;
+    char header[FRAME_HEADER_SIZE];
+    encode_header(header, type, static_cast<uint32_t>(payload.size()));
+    out.append(header, sizeof(header));
+    out += payload;
+}
+
+bool Bench::flush(size_t index) {
+    FakeWorker& w = workers[index];
+    while (w.out_off < w.out.size()) {
+        ssize_t n = send(w.fd, w.out.data() + w.out_off, w.out.size() - w.out_off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return false;
+        }
+        w.out_off += n;
+    }
+    if (w.out_off == w.out.size()) {
+        w.out.clear();
+        w.out_off = 0;
+    }
+
+    bool want_write = !w.out.empty();
+    if (want_write != w.want_write) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP | (want_write ? static_cast<uint32_t>(EPOLLOUT) : 0u);
+        ev.data.u64 = index;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, w.fd, &ev);
+        w.want_write = want_write;
+    }
+    return true;
+}
+
+void Bench::drop(size_t index) {
+    FakeWorker& w = workers[index];
+    if (w.fd >= 0) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, w.fd, nullptr);
+        close(w.fd);
+        w.fd = -1;
+    }
+    w.busy = false;
+}
+
+void Bench::handle_frame(size_t index, Frame& frame) {
+    FakeWorker& w = workers[index];
+    uint64_t now = monotonic_us();
+
+    switch (frame.type) {
+        case MsgType::PAYLOAD_OFFER: {
+            // Always cached, the payload transfer is not what is measured
+            PayloadOffer offer;
+            if (decode_payload_offer(frame.payload, offer)) {
+                PayloadStatus status = {offer.digest, true};
+                queue_frame(index, MsgType::PAYLOAD_STATUS, encode_payload_status(status));
+            }
+            break;
+        }
+        case MsgType::TASK_RANGE: {
+            if (!decode_task_range(frame.payload, w.task)) {
+                break;
+            }
+            if (first_task_us == 0) {
+                first_task_us = now;
+            }
+            if (w.done_sent_us > 0) {
+                result.dispatch_ms.push_back((now - w.done_sent_us) / 1000.0);
+                w.done_sent_us = 0;
+            }
+            w.busy = true;
+            result.tasks++;
+
+            uint64_t compute_us = static_cast<uint64_t>((w.task.end - w.task.start) * config.item_ms * 1000);
+            timers.emplace(now + compute_us, index, w.task.task_id);
+            break;
+        }
+        case MsgType::CANCEL:
+            if (frame.payload.size() >= 4 && w.busy && get_u32(frame.payload.data()) == w.task.task_id) {
+                w.busy = false;
+            }
+            break;
+        case MsgType::HEARTBEAT:
+            queue_frame(index, MsgType::HEARTBEAT, frame.payload);
+            break;
+        default:
+            break;
+    }
+}
+
+void Bench::finish_task(size_t index, uint32_t task_id) {
+    FakeWorker& w = workers[index];
+    if (w.fd < 0 || !w.busy || w.task.task_id != task_id) {
+        return;
+    }
+
+    // output_bytes per item, each item a line of its own
+    std::string line(config.output_bytes > 0 ? config.output_bytes : 1, 'x');
+    line.back() = '\n';
+    uint64_t total = (w.task.end - w.task.start) * line.size();
+
+    std::string chunk;
+    uint64_t left = total;
+    while (left > 0) {
+        chunk.clear();
+        put_u32(chunk, task_id);
+        while (left > 0 && chunk.size() + line.size() <= BENCH_CHUNK_SIZE + 4) {
+            chunk += line;
+            left -= line.size();
+        }
+        queue_frame(index, MsgType::RESULT_CHUNK, chunk);
+    }
+    result.result_bytes += total;
+
+    // A failure announces more bytes than were sent, the coordinator drops the output and retries
+    bool fail = config.failure_rate > 0 && std::uniform_real_distribution<double>(0, 1)(random) < config.failure_rate;
+    TaskDone done = {task_id, 0, total + (fail ? 1 : 0)};
+    queue_frame(index, MsgType::DONE, encode_done(done));
+    result.failed += fail ? 1 : 0;
+
+    w.busy = false;
+    w.done_sent_us = monotonic_us();
+    if (!flush(index)) {
+        drop(index);
+    }
+}
+
+bool Bench::run(int count, RunResult& out) {
+    result = RunResult();
+    result.workers = count;
+    result.exit_status = -1;
+    first_task_us = 0;
+    timers = decltype(timers)();
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    pid_t pid = launch(count);
+    if (pid < 0 || epoll_fd < 0) {
+        perror("launch");
+        return false;
+    }
+    if (!connect_all(count)) {
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+        for (size_t i = 0; i < workers.size(); i++) {
+            drop(i);
+        }
+        close(epoll_fd);
+        return false;
+    }
+
+    char buf[64 * 1024];
+    struct epoll_event events[BENCH_MAX_EVENTS];
+    struct rusage usage;
+    int status = 0;
+    uint64_t exited_us = 0;
+
+    while (1) {
+        // The coordinator exits on its own once the job is done
+        if (wait4(pid, &status, WNOHANG, &usage) == pid) {
+            exited_us = monotonic_us();
+            break;
+        }
+
+        uint64_t now = monotonic_us();
+        int timeout = 50;
+        if (!timers.empty()) {
+            uint64_t due = std::get<0>(timers.top());
+            timeout = due > now ? std::min<int>(timeout, (due - now + 999) / 1000) : 0;
+        }
+
+        int n = epoll_wait(epoll_fd, events, BENCH_MAX_EVENTS, timeout);
+        for (int i = 0; i < n; i++) {
+            size_t index = events[i].data.u64;
+            FakeWorker& w = workers[index];
+            if (w.fd < 0) {
+                continue;
+            }
+
+            if (events[i].events & EPOLLOUT && !flush(index)) {
+                drop(index);
+                continue;
+            }
+            if (!(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+                continue;
+            }
+
+            bool open = true;
+            while (1) {
+                ssize_t received = recv(w.fd, buf, sizeof(buf), 0);
+                if (received > 0) {
+                    w.reader.feed(buf, received);
+                    continue;
+                }
+                if (received < 0 && errno == EINTR) {
+                    continue;
+                }
+                open = received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+                break;
+            }
+
+            Frame frame;
+            while (w.reader.next(frame) > 0) {
+                handle_frame(index, frame);
+            }
+            if (!open || !flush(index)) {
+                drop(index);
+            }
+        }
+
+        now = monotonic_us();
+        while (!timers.empty() && std::get<0>(timers.top()) <= now) {
+            Due due = timers.top();
+            timers.pop();
+            finish_task(std::get<1>(due), std::get<2>(due));
+        }
+    }
+
+    for (size_t i = 0; i < workers.size(); i++) {
+        drop(i);
+    }
+    close(epoll_fd);
+
+    result.exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    result.makespan = first_task_us > 0 ? (exited_us - first_task_us) / 1e6 : 0;
+    result.cpu_seconds = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+                         usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    out = result;
+    return true;
+}
+
+static double percentile(std::vector<double>& samples, double p) {
+    if (samples.empty()) {
+        return 0;
+    }
+    size_t k = std::min(samples.size() - 1, static_cast<size_t>(p * samples.size()));
+    std::nth_element(samples.begin(), samples.begin() + k, samples.end());
+    return samples[k];
+}
+
+static std::string sibling_binary(const char* name) {
+    char self[PATH_MAX];
+    ssize_t n = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (n <= 0) {
+        return name;
+    }
+    self[n] = '\0';
+    return std::string(dirname(self)) + "/" + name;
+}
+
+int main(int argc, char** argv) {
+    signal(SIGPIPE, SIG_IGN);
+
+    BenchConfig config;
+    config.coordinator = sibling_binary("PeerPulse");
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.rfind("--coordinator=", 0) == 0) {
+            config.coordinator = arg.substr(strlen("--coordinator="));
+        } else if (arg.rfind("--workers=", 0) == 0) {
+            // Comma separated worker counts, one run each
+            config.scale.clear();
+            const char* p = arg.c_str() + strlen("--workers=");
+            while (*p) {
+                char* end;
+                long count = strtol(p, &end, 10);
+                if (end == p) {
+                    break;
+                }
+                if (count > 0) {
+                    config.scale.push_back(static_cast<int>(count));
+                }
+                p = *end == ',' ? end + 1 : end;
+            }
+        } else if (arg.rfind("--items=", 0) == 0) {
+            config.items = strtoull(arg.c_str() + strlen("--items="), nullptr, 10);
+        } else if (arg.rfind("--item-ms=", 0) == 0) {
+            config.item_ms = atof(arg.c_str() + strlen("--item-ms="));
+        } else if (arg.rfind("--output-bytes=", 0) == 0) {
+            config.output_bytes = strtoull(arg.c_str() + strlen("--output-bytes="), nullptr, 10);
+        } else if (arg.rfind("--failure-rate=", 0) == 0) {
+            config.failure_rate = atof(arg.c_str() + strlen("--failure-rate="));
+        } else if (arg.rfind("--task-seconds=", 0) == 0) {
+            config.task_seconds = atof(arg.c_str() + strlen("--task-seconds="));
+        } else if (arg.rfind("--seed=", 0) == 0) {
+            config.seed = strtoul(arg.c_str() + strlen("--seed="), nullptr, 10);
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--workers=1,10,100,1000] [--items=N] [--item-ms=MS] "
+                      << "[--output-bytes=N] [--failure-rate=P] [--task-seconds=N] [--seed=N] "
+                      << "[--coordinator=PATH]" << std::endl;
+            return 1;
+        }
+    }
+
+    // Both ends of every connection live on this machine
+    struct rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+
+    char dir_template[] = "/tmp/peerpulse-bench-XXXXXX";
+    if (!mkdtemp(dir_template)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string dir = dir_template;
+    FILE* payload = fopen((dir + "/payload.py").c_str(), "w");
+    if (!payload) {
+        perror("payload");
+        return 1;
+    }
+    fputs("# PeerPulse benchmark payload, the fake workers never run it\n", payload);
+    fclose(payload);
+
+    printf("Coordinator %s, %llu items, %.3f ms and %zu bytes per item, %.1f%% failures\n",
+           config.coordinator.c_str(), static_cast<unsigned long long>(config.items), config.item_ms,
+           config.output_bytes, config.failure_rate * 100);
+    printf("Coordinator output and logs in %s\n\n", dir.c_str());
+    printf("%8s %8s %8s %12s %12s %12s %10s %12s %6s\n", "workers", "tasks", "failed", "makespan_s",
+           "dispatch_p50", "dispatch_p99", "coord_cpu", "result_MB/s", "exit");
+
+    Bench bench(config, dir);
+    int worst = 0;
+    for (int count : config.scale) {
+        RunResult result;
+        if (!bench.run(count, result)) {
+            printf("%8d run failed, see %s/coordinator.log\n", count, dir.c_str());
+            worst = 1;
+            continue;
+        }
+
+        double p50 = percentile(result.dispatch_ms, 0.5);
+        double p99 = percentile(result.dispatch_ms, 0.99);
+        double rate = result.makespan > 0 ? result.result_bytes / result.makespan / (1 << 20) : 0;
+        printf("%8d %8llu %8llu %12.3f %10.3fms %10.3fms %9.3fs %12.1f %6d\n", count,
+               static_cast<unsigned long long>(result.tasks), static_cast<unsigned long long>(result.failed),
+               result.makespan, p50, p99, result.cpu_seconds, rate, result.exit_status);
+        fflush(stdout);
+        worst = std::max(worst, result.exit_status != 0 ? 1 : 0);
+    }
+    return worst;
+}
@@ -1,10 +1,24 @@
 #include <client.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#include <errno.h>
+#include <sys/sendfile.h>
 
 
 size_t Client::send_buf(const char *buf, size_t file_size) {
-    size_t bytes_sent = send(client_fd, buf, file_size, 0);
+    size_t bytes_sent = 0;
+
+    // Loop over short writes so callers get all-or-error semantics
+    while (bytes_sent < file_size) {
+        ssize_t sent = send(client_fd, buf + bytes_sent, file_size - bytes_sent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        bytes_sent += sent;
+    }
 
     return bytes_sent;
 }
@@ -21,7 +35,141 @@ size_t Client::send_int(int value) {
     uint32_t net_value = htonl(static_cast<uint32_t>(value));
     
     // Send the 4-byte integer
-    ssize_t sent = send(client_fd, &net_value, sizeof(net_value), 0);
-    return sent;
+    return send_buf(reinterpret_cast<const char*>(&net_value), sizeof(net_value));
+}
+
+void Client::queue_buf(const char *buf, size_t size) {
+    // Coalesce small writes into the last byte segment
+    if (out_queue.empty() || out_queue.back().file_fd >= 0) {
+        out_queue.emplace_back();
+    }
+    out_queue.back().bytes.append(buf, size);
+}
+
+void Client::queue_frame(MsgType type, const char *payload, size_t size) {
+    char header[FRAME_HEADER_SIZE];
+    encode_header(header, type, static_cast<uint32_t>(size));
+    queue_buf(header, sizeof(header));
+    queue_buf(payload, size);
+}
+
+void Client::queue_file(int fd, off_t offset, size_t size) {
+    if (size == 0) {
+        return;
+    }
+    OutSegment segment;
+    segment.file_fd = fd;
+    segment.file_off = offset;
+    segment.file_len = size;
+    out_queue.push_back(segment);
+}
+
+bool Client::send_frame(MsgType type, const char *payload, size_t size) {
+    char header[FRAME_HEADER_SIZE];
+    encode_header(header, type, static_cast<uint32_t>(size));
+    return send_buf(header, sizeof(header)) == sizeof(header) &&
+           send_buf(payload, size) == size;
+}
+
+bool Client::recv_frame(Frame &frame) {
+    char buf[4096];
+
+    while (1) {
+        int status = reader.next(frame);
+        if (status != 0) {
+            return status > 0;
+        }
+
+        ssize_t received = recv(client_fd, buf, sizeof(buf), 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return false;
+        }
+        reader.feed(buf, received);
+    }
 }
 
+bool Client::recv_header(MsgType &type, uint32_t &length) {
+    char buf[FRAME_HEADER_SIZE];
+
+    while (1) {
+        int status = reader.next_header(type, length);
+        if (status != 0) {
+            return status > 0;
+        }
+
+        // Never read past the header so the payload can be streamed
+        ssize_t received = recv(client_fd, buf, FRAME_HEADER_SIZE - reader.buffered(), 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return false;
+        }
+        reader.feed(buf, received);
+    }
+}
+
+ssize_t Client::recv_some(char *buf, size_t size) {
+    // Bytes the reader already pulled off the socket come first
+    if (reader.buffered() > 0) {
+        return reader.take(buf, size);
+    }
+
+    while (1) {
+        ssize_t received = recv(client_fd, buf, size, 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        return received;
+    }
+}
+
+ssize_t Client::flush() {
+    size_t sent_total = 0;
+
+    while (!out_queue.empty()) {
+        OutSegment& segment = out_queue.front();
+        ssize_t sent;
+
+        if (segment.file_fd >= 0) {
+            // Kernel copies straight from the page cache, sendfile advances file_off
+            sent = sendfile(client_fd, segment.file_fd, &segment.file_off, segment.file_len);
+        } else {
+            sent = send(client_fd, segment.bytes.data() + out_off, segment.bytes.size() - out_off, MSG_NOSIGNAL);
+        }
+
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;  // Socket buffer full, wait for EPOLLOUT
+            }
+            return -1;
+        }
+        if (sent == 0 && segment.file_fd >= 0) {
+            errno = EIO;  // File shrank underneath us
+            return -1;
+        }
+        sent_total += sent;
+
+        // Short writes leave the segment at the front for the next EPOLLOUT
+        bool segment_done;
+        if (segment.file_fd >= 0) {
+            segment.file_len -= sent;
+            segment_done = segment.file_len == 0;
+        } else {
+            out_off += sent;
+            segment_done = out_off == segment.bytes.size();
+        }
+        if (segment_done) {
+            out_queue.pop_front();
+            out_off = 0;
+        }
+    }
+
+    return sent_total;
+}
@@ -0,0 +1,21 @@
+#include <events.h>
+#include <stdio.h>
+#include <time.h>
+
+void ConsoleSink::add_status_message(const std::string& message) {
+    time_t current_time;
+    char time_str[16];
+    time(&current_time);
+    strftime(time_str, sizeof(time_str), "[%H:%M:%S]", localtime(&current_time));
+
+    printf("%s %s\n", time_str, message.c_str());
+}
+
+void ConsoleSink::set_scheduler_summary(const std::string& summary) {
+    // Only print it when it changes, it is refreshed on every batch of messages
+    if (summary.empty() || summary == last_summary) {
+        return;
+    }
+    last_summary = summary;
+    add_status_message("Chunks: " + summary);
+}
@@ -0,0 +1,273 @@
+#include <journal.h>
+#include <protocol.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <algorithm>
+
+// Type, length and checksum around every payload
+constexpr size_t RECORD_OVERHEAD = 1 + 4 + 4;
+
+static uint32_t fnv1a(const char* data, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= static_cast<uint8_t>(data[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static bool write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+std::string Journal::record(JournalRecord type, const std::string& payload) {
+    std::string out(1, static_cast<char>(type));
+    put_u32(out, payload.size());
+    out += payload;
+    put_u32(out, fnv1a(out.data(), out.size()));
+    return out;
+}
+
+std::string Journal::job(const JobKey& key) {
+    std::string payload = key.digest;
+    put_u64(payload, key.items);
+    payload.push_back(static_cast<char>(key.op));
+    put_u32(payload, key.k);
+    return payload;
+}
+
+std::string Journal::prefix(uint64_t items, uint64_t bytes) {
+    std::string payload;
+    put_u64(payload, items);
+    put_u64(payload, bytes);
+    return payload;
+}
+
+std::string Journal::fold(const std::vector<ItemRange>& ranges, const Partial& partial) {
+    std::string payload;
+    put_u32(payload, ranges.size());
+    for (const ItemRange& range : ranges) {
+        put_u64(payload, range.first);
+        put_u64(payload, range.second);
+    }
+    // Same layout as a PARTIAL frame, without task ids
+    return payload + encode_partial_batch(std::vector<uint32_t>(), partial);
+}
+
+bool Journal::open(const std::string& path, const std::string& result_path, const std::string& initial) {
+    close();
+
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror(("Error opening journal: " + path).c_str());
+        return false;
+    }
+    if (!write_all(fd, initial.data(), initial.size()) || fdatasync(fd) < 0) {
+        perror("Error writing journal");
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+    result_fd = ::open(result_path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    stopping = false;
+    if (pthread_create(&thread, NULL, sync_thread_fn, this) != 0) {
+        perror("journal thread");
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+    return true;
+}
+
+void Journal::append(JournalRecord type, const std::string& payload) {
+    if (fd < 0) {
+        return;
+    }
+    pthread_mutex_lock(&mutex);
+    bool wake = pending.empty();
+    pending += record(type, payload);
+    if (wake) {
+        pthread_cond_signal(&cond);
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+void Journal::close() {
+    if (fd < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&mutex);
+    stopping = true;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&mutex);
+
+    pthread_join(thread, NULL);
+    ::close(fd);
+    fd = -1;
+    if (result_fd >= 0) {
+        ::close(result_fd);
+        result_fd = -1;
+    }
+}
+
+void Journal::write_batch(const std::string& batch) {
+    // Output a PREFIX points at has to be on disk before the PREFIX is
+    if (result_fd >= 0) {
+        fdatasync(result_fd);
+    }
+    if (!write_all(fd, batch.data(), batch.size()) || fdatasync(fd) < 0) {
+        perror("Error writing journal");
+    }
+}
+
+void Journal::sync_loop() {
+    pthread_mutex_lock(&mutex);
+    while (1) {
+        while (pending.empty() && !stopping) {
+            pthread_cond_wait(&cond, &mutex);
+        }
+
+        // Let the batch grow, one sync covers all of it
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += JOURNAL_SYNC_MS / 1000;
+        deadline.tv_nsec += (JOURNAL_SYNC_MS % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (!stopping && pthread_cond_timedwait(&cond, &mutex, &deadline) != ETIMEDOUT) {
+        }
+
+        std::string batch;
+        batch.swap(pending);
+        bool last = stopping;
+        pthread_mutex_unlock(&mutex);
+
+        if (!batch.empty()) {
+            write_batch(batch);
+        }
+
+        pthread_mutex_lock(&mutex);
+        if (last && pending.empty()) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+bool Journal::recover(const std::string& path, const JobKey& key, uint64_t result_size,
+                      ResultReducer& reducer, JournalState& state) {
+    int in = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        return false;
+    }
+    std::string data;
+    char buf[64 * 1024];
+    ssize_t n;
+    while ((n = read(in, buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        data.append(buf, n);
+    }
+    ::close(in);
+
+    state = JournalState();
+    bool matched = false;
+    size_t off = 0;
+
+    // Stops at the end, or at a record cut short by a crash
+    while (data.size() - off >= RECORD_OVERHEAD) {
+        const char* p = data.data() + off;
+        uint32_t length = get_u32(p + 1);
+        if (data.size() - off - RECORD_OVERHEAD < length ||
+            get_u32(p + 5 + length) != fnv1a(p, 5 + length)) {
+            break;
+        }
+        JournalRecord type = static_cast<JournalRecord>(p[0]);
+        std::string payload(p + 5, length);
+        off += RECORD_OVERHEAD + length;
+
+        if (!matched) {
+            // Another job's journal, or none we can read
+            if (type != JournalRecord::JOB || payload != job(key)) {
+                return false;
+            }
+            matched = true;
+            continue;
+        }
+
+        switch (type) {
+            case JournalRecord::PREFIX: {
+                if (payload.size() != 16) {
+                    break;
+                }
+                uint64_t items = get_u64(payload.data());
+                uint64_t bytes = get_u64(payload.data() + 8);
+                if (bytes <= result_size && items > state.prefix_items) {
+                    state.prefix_items = items;
+                    state.prefix_bytes = bytes;
+                }
+                break;
+            }
+            case JournalRecord::FOLD: {
+                if (payload.size() < 4) {
+                    break;
+                }
+                uint32_t count = get_u32(payload.data());
+                if (payload.size() - 4 < static_cast<uint64_t>(count) * 16) {
+                    break;
+                }
+                std::vector<uint32_t> no_ids;
+                Partial partial;
+                if (!decode_partial_batch(payload.substr(4 + static_cast<size_t>(count) * 16), no_ids, partial)) {
+                    break;
+                }
+                for (uint32_t i = 0; i < count; i++) {
+                    const char* range = payload.data() + 4 + i * 16;
+                    state.folded.push_back({get_u64(range), get_u64(range + 8)});
+                }
+                reducer.absorb(partial);
+                break;
+            }
+            case JournalRecord::END:
+                return false;
+            default:
+                break;
+        }
+    }
+
+    // Rerun ranges overlap, the caller wants them disjoint
+    std::sort(state.folded.begin(), state.folded.end());
+    std::vector<ItemRange> merged;
+    for (const ItemRange& range : state.folded) {
+        if (!merged.empty() && range.first <= merged.back().second) {
+            merged.back().second = std::max(merged.back().second, range.second);
+        } else {
+            merged.push_back(range);
+        }
+    }
+    state.folded.swap(merged);
+    return matched;
+}
@@ -2,6 +2,8 @@
 #include <tui.h>
 #include <server.h>
 #include <signal.h>
+#include <string.h>
+#include <reducer.h>
 
 // Global pointer for cleanup in signal handler
 TUI* g_tui = nullptr;
@@ -19,25 +21,139 @@ int main(int argc, char** argv) {
     // Register signal handlers for proper cleanup
     signal(SIGINT, cleanup_handler);
     signal(SIGTERM, cleanup_handler);
+    // Dead workers must surface as send errors, not kill the coordinator
+    signal(SIGPIPE, SIG_IGN);
+
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0] << " <script> <item count> [--task-seconds=N] [--fanout=K] [--task-timeout=N] "
+                  << "[--backup-factor=N] [--task-memory=MB] [--metrics-port=N] "
+                  << "[--reduce=sum|min|max|topk:K|histogram|concat] [--reduce-fanin=K] [--fresh] "
+                  << "[--result-cache=MB] [--cache-params=TEXT] [--headless] [--workers=N] [--wait=SECONDS]"
+                  << std::endl;
+        return 1;
+    }
 
     std::string fileName;
     int nItems;
+    double taskSeconds = 0;
+    int fanout = 0;
+    double taskTimeout = 0;
+    double backupFactor = -1;
+    uint64_t taskMemoryMb = 0;
+    int metricsPort = METRICS_PORT;
+    ReduceOp reduceOp = ReduceOp::CONCAT;
+    size_t topK = 10;
+    int reduceFanin = 0;
+    bool fresh = false;
+    uint64_t resultCacheMb = RESULT_CACHE_BYTES >> 20;
+    std::string cacheParams;
+    bool headless = false;
+    int minWorkers = 1;
+    double waitSeconds = 60;
+
+    // Optional flags after the positional arguments
+    for (int i = 3; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.rfind("--task-seconds=", 0) == 0) {
+            taskSeconds = atof(arg.c_str() + strlen("--task-seconds="));
+        } else if (arg.rfind("--fanout=", 0) == 0) {
+            fanout = atoi(arg.c_str() + strlen("--fanout="));
+        } else if (arg.rfind("--task-timeout=", 0) == 0) {
+            taskTimeout = atof(arg.c_str() + strlen("--task-timeout="));
+        } else if (arg.rfind("--backup-factor=", 0) == 0) {
+            backupFactor = atof(arg.c_str() + strlen("--backup-factor="));
+        } else if (arg.rfind("--task-memory=", 0) == 0) {
+            taskMemoryMb = strtoull(arg.c_str() + strlen("--task-memory="), nullptr, 10);
+        } else if (arg.rfind("--metrics-port=", 0) == 0) {
+            metricsPort = atoi(arg.c_str() + strlen("--metrics-port="));
+        } else if (arg.rfind("--reduce=", 0) == 0) {
+            if (!parse_reduce(arg.substr(strlen("--reduce=")), reduceOp, topK)) {
+                std::cerr << "Unknown reducer: " << arg << std::endl;
+                return 1;
+            }
+        } else if (arg.rfind("--reduce-fanin=", 0) == 0) {
+            reduceFanin = atoi(arg.c_str() + strlen("--reduce-fanin="));
+        } else if (arg.rfind("--result-cache=", 0) == 0) {
+            resultCacheMb = strtoull(arg.c_str() + strlen("--result-cache="), nullptr, 10);
+        } else if (arg.rfind("--cache-params=", 0) == 0) {
+            cacheParams = arg.substr(strlen("--cache-params="));
+        } else if (arg == "--fresh") {
+            fresh = true;
+        } else if (arg == "--headless") {
+            headless = true;
+        } else if (arg.rfind("--workers=", 0) == 0) {
+            minWorkers = atoi(arg.c_str() + strlen("--workers="));
+        } else if (arg.rfind("--wait=", 0) == 0) {
+            waitSeconds = atof(arg.c_str() + strlen("--wait="));
+        } else {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            return 1;
+        }
+    }
     
-    try {
-        TUI tui;
-        g_tui = &tui;  // Store for signal handler
-        
-        PeerServer server(tui);
-        // Script Name
-        fileName = argv[1];
-        
-        nItems = atoi(argv[2]);
-        
+    // Script Name
+    fileName = argv[1];
+
+    nItems = atoi(argv[2]);
+
+    auto configure = [&](PeerServer& server) {
         server.set_item_count(nItems);
-        server.addFile(fileName);
-        server.run();  // This will now run the TUI in the main thread
-        
-        g_tui = nullptr;  // Clear before normal exit
+        if (taskSeconds > 0) {
+            server.set_target_task_seconds(taskSeconds);
+        }
+        if (taskTimeout > 0) {
+            server.set_task_timeout(taskTimeout);
+        }
+        if (backupFactor >= 0) {
+            server.set_backup_factor(backupFactor);
+        }
+        server.set_task_memory(taskMemoryMb << 20);
+        server.set_relay_fanout(fanout);
+        server.set_metrics_port(metricsPort > 0 && metricsPort <= 65535 ? metricsPort : 0);
+        server.set_reduce(reduceOp, topK);
+        server.set_reduce_fanin(reduceFanin);
+        server.set_resume(!fresh);
+        server.set_result_cache(resultCacheMb << 20);
+        server.set_cache_params(cacheParams);
+        return server.addFile(fileName);
+    };
+
+    try {
+        if (headless) {
+            // No terminal, progress goes to stdout and the exit status tells how it went
+            setvbuf(stdout, nullptr, _IOLBF, 0);
+            ConsoleSink console;
+            PeerServer server(console);
+            if (!configure(server)) {
+                return 1;
+            }
+            return server.run_headless(minWorkers > 0 ? minWorkers : 1, waitSeconds);
+        }
+
+        bool loaded;
+        {
+            TUI tui;
+            g_tui = &tui;  // Store for signal handler
+
+            PeerServer server(tui);
+            tui.set_server_ref(&server);
+            loaded = configure(server);
+
+            // The TUI runs in the main thread, the reactor beside it
+            if (loaded) {
+                server.start();
+                tui.run();
+                server.stop();
+            }
+
+            g_tui = nullptr;  // Clear before normal exit
+        }
+
+        // Said once the terminal is back, the screen swallowed the details
+        if (!loaded) {
+            std::cerr << "Error: could not load " << fileName << " as the payload" << std::endl;
+            return 1;
+        }
     } catch (const std::exception& e) {
         std::cerr << "Error: " << e.what() << std::endl;
         return 1;
@@ -0,0 +1,252 @@
+#include <merger.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+ResultMerger::ResultMerger(ResultWriter& out, size_t memory_budget)
+    : out(out), memory_budget(memory_budget) {
+    const char* tmp = getenv("TMPDIR");
+    spill_dir = tmp && *tmp ? tmp : "/tmp";
+}
+
+ResultMerger::~ResultMerger() {
+    reset(0);
+}
+
+void ResultMerger::reset(uint64_t first, uint64_t bytes) {
+    for (auto& entry : staging) {
+        release(entry.second);
+    }
+    staging.clear();
+    while (!committed.empty()) {
+        release(committed.top());
+        committed.pop();
+    }
+    memory_used = 0;
+    spill_count = 0;
+    cursor = first;
+    written = bytes;
+    gaps = 0;
+    lost.clear();
+}
+
+void ResultMerger::release(Run* run) {
+    if (run->spill_fd >= 0) {
+        close(run->spill_fd);
+    }
+    memory_used -= run->data.size();
+    delete run;
+}
+
+void ResultMerger::begin(uint32_t attempt, uint64_t start, uint64_t end) {
+    abort(attempt);
+
+    Run* run = new Run;
+    run->start = start;
+    run->end = end;
+    staging[attempt] = run;
+}
+
+// Moves the in-memory part of a run to an unlinked temp file
+bool ResultMerger::spill(Run* run) {
+    std::string path = spill_dir + "/peerpulse-spill-XXXXXX";
+    int fd = mkstemp(&path[0]);
+    if (fd < 0) {
+        perror("spill file");
+        return false;
+    }
+    unlink(path.c_str());
+
+    size_t written = 0;
+    while (written < run->data.size()) {
+        ssize_t n = write(fd, run->data.data() + written, run->data.size() - written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("spill write");
+            close(fd);
+            return false;
+        }
+        written += n;
+    }
+
+    memory_used -= run->data.size();
+    std::string().swap(run->data);
+    run->spill_fd = fd;
+    spill_count++;
+    return true;
+}
+
+void ResultMerger::append(uint32_t attempt, const char* data, size_t len) {
+    auto it = staging.find(attempt);
+    if (it == staging.end()) {
+        return;
+    }
+    Run* run = it->second;
+    run->size += len;
+
+    if (run->spill_fd >= 0) {
+        while (len > 0) {
+            ssize_t n = write(run->spill_fd, data, len);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("spill write");
+                return;
+            }
+            data += n;
+            len -= n;
+        }
+        return;
+    }
+
+    run->data.append(data, len);
+    memory_used += len;
+
+    // Over budget, the attempt that is growing goes to disk
+    if (memory_used > memory_budget) {
+        spill(run);
+    }
+}
+
+bool ResultMerger::emit(Run* run) {
+    bool keep = cache && run->cacheable && run->path.empty();
+    if (run->spill_fd < 0 && run->path.empty()) {
+        out.write(run->data.data(), run->data.size());
+        written += run->size;
+        if (keep) {
+            // The run is released next, the cache takes its buffer
+            memory_used -= run->data.size();
+            cache->store(run->start, run->end, std::move(run->data));
+        }
+        return true;
+    }
+
+    // A cached file may have been evicted or cut short since the job
+    // started, its range has to be run again
+    int fd = run->spill_fd;
+    if (!run->path.empty()) {
+        struct stat st;
+        fd = open(run->path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || fstat(fd, &st) < 0 || static_cast<uint64_t>(st.st_size) != run->size) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            lost.push_back({run->start, run->end, run->size, run->path});
+            return false;
+        }
+    }
+    written += run->size;
+
+    char buf[64 * 1024];
+    off_t offset = 0;
+    while (static_cast<uint64_t>(offset) < run->size) {
+        ssize_t n = pread(fd, buf, sizeof(buf), offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            perror("spill read");
+            break;
+        }
+        out.write(buf, n);
+        offset += n;
+    }
+
+    if (!run->path.empty()) {
+        close(fd);
+    } else if (keep && static_cast<uint64_t>(offset) == run->size) {
+        int copy = dup(fd);
+        if (copy >= 0) {
+            cache->store(run->start, run->end, copy, run->size);
+        }
+    }
+    return true;
+}
+
+void ResultMerger::commit(uint32_t attempt) {
+    auto it = staging.find(attempt);
+    if (it == staging.end()) {
+        return;
+    }
+    committed.push(it->second);
+    staging.erase(it);
+    drain();
+}
+
+void ResultMerger::skip(uint64_t start, uint64_t end) {
+    Run* run = new Run;
+    run->start = start;
+    run->end = end;
+    committed.push(run);
+    drain();
+}
+
+// Writes every run that now continues the output
+void ResultMerger::drain() {
+    while (!committed.empty() && committed.top()->start <= cursor) {
+        Run* run = committed.top();
+        committed.pop();
+        if (run->end > cursor && emit(run)) {
+            cursor = run->end;
+        }
+        release(run);
+    }
+}
+
+void ResultMerger::cached(uint64_t start, uint64_t end, const std::string& path, uint64_t size) {
+    Run* run = new Run;
+    run->start = start;
+    run->end = end;
+    run->path = path;
+    run->size = size;
+    committed.push(run);
+    drain();
+}
+
+std::vector<CachedRange> ResultMerger::take_lost() {
+    std::vector<CachedRange> ranges;
+    ranges.swap(lost);
+    return ranges;
+}
+
+void ResultMerger::keep_uncached(uint32_t attempt) {
+    auto it = staging.find(attempt);
+    if (it != staging.end()) {
+        it->second->cacheable = false;
+    }
+}
+
+void ResultMerger::abort(uint32_t attempt) {
+    auto it = staging.find(attempt);
+    if (it == staging.end()) {
+        return;
+    }
+    release(it->second);
+    staging.erase(it);
+}
+
+void ResultMerger::finish(uint64_t last) {
+    while (!committed.empty()) {
+        Run* run = committed.top();
+        committed.pop();
+        if (run->end > cursor) {
+            gaps += run->start > cursor ? run->start - cursor : 0;
+            if (!emit(run)) {
+                gaps += run->end - std::max(run->start, cursor);
+            }
+            cursor = run->end;
+        }
+        release(run);
+    }
+    if (last > cursor) {
+        gaps += last - cursor;
+        cursor = last;
+    }
+}
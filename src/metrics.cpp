@@ -0,0 +1,212 @@
+#include <metrics.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// Longest request read before answering, only the request line matters
+constexpr size_t METRICS_REQUEST_SIZE = 4096;
+
+// A scraper that stalls longer than this is dropped
+constexpr int METRICS_IO_TIMEOUT_MS = 1000;
+
+size_t metric_shard() {
+    static std::atomic<size_t> next_shard{0};
+    static thread_local size_t shard = next_shard.fetch_add(1, std::memory_order_relaxed) % METRIC_SHARDS;
+    return shard;
+}
+
+uint64_t Counter::value() const {
+    uint64_t total = 0;
+    for (const Cell& cell : cells) {
+        total += cell.value.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+void Histogram::observe(double seconds) {
+    size_t bucket = 0;
+    while (bucket < LATENCY_BUCKET_COUNT && seconds > LATENCY_BUCKETS[bucket]) {
+        bucket++;
+    }
+
+    Cell& cell = cells[metric_shard()];
+    cell.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    cell.sum_us.fetch_add(static_cast<uint64_t>(seconds * 1e6), std::memory_order_relaxed);
+}
+
+void Histogram::render(std::string& out, const char* name) const {
+    uint64_t counts[LATENCY_BUCKET_COUNT + 1] = {};
+    uint64_t sum_us = 0;
+    for (const Cell& cell : cells) {
+        for (size_t i = 0; i <= LATENCY_BUCKET_COUNT; i++) {
+            counts[i] += cell.buckets[i].load(std::memory_order_relaxed);
+        }
+        sum_us += cell.sum_us.load(std::memory_order_relaxed);
+    }
+
+    char line[128];
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i <= LATENCY_BUCKET_COUNT; i++) {
+        cumulative += counts[i];
+        if (i < LATENCY_BUCKET_COUNT) {
+            snprintf(line, sizeof(line), "%s_bucket{le=\"%g\"} %llu\n", name, LATENCY_BUCKETS[i],
+                     static_cast<unsigned long long>(cumulative));
+        } else {
+            snprintf(line, sizeof(line), "%s_bucket{le=\"+Inf\"} %llu\n", name,
+                     static_cast<unsigned long long>(cumulative));
+        }
+        out += line;
+    }
+    snprintf(line, sizeof(line), "%s_sum %.6f\n%s_count %llu\n", name, sum_us / 1e6, name,
+             static_cast<unsigned long long>(cumulative));
+    out += line;
+}
+
+static void render_value(std::string& out, const char* name, const char* type, const char* help, long long value) {
+    char line[256];
+    snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n%s %lld\n", name, help, name, type, name, value);
+    out += line;
+}
+
+std::string ServerMetrics::render() const {
+    std::string out;
+    render_value(out, "peerpulse_tasks_dispatched_total", "counter", "Ranges handed to workers, backups included",
+                 tasks_dispatched.value());
+    render_value(out, "peerpulse_tasks_completed_total", "counter", "Ranges whose output was accepted",
+                 tasks_completed.value());
+    render_value(out, "peerpulse_tasks_failed_total", "counter", "Ranges lost with their worker or cut short",
+                 tasks_failed.value());
+    render_value(out, "peerpulse_task_retries_total", "counter", "Lost ranges put back on the queue",
+                 task_retries.value());
+    render_value(out, "peerpulse_task_backups_total", "counter", "Backup copies started for stragglers",
+                 task_backups.value());
+    render_value(out, "peerpulse_bytes_sent_total", "counter", "Bytes written to worker sockets",
+                 bytes_sent.value());
+    render_value(out, "peerpulse_bytes_received_total", "counter", "Bytes read from worker sockets",
+                 bytes_received.value());
+    render_value(out, "peerpulse_workers_connected", "gauge", "Worker connections currently open",
+                 workers_connected.value());
+    render_value(out, "peerpulse_queue_items", "gauge", "Items of the current job not handed out yet",
+                 queue_items.value());
+    render_value(out, "peerpulse_tasks_in_flight", "gauge", "Ranges currently running on workers",
+                 tasks_in_flight.value());
+    render_value(out, "peerpulse_items_done", "gauge", "Items of the current job completed by workers",
+                 items_done.value());
+
+    out += "# HELP peerpulse_task_seconds Time from dispatch to accepted output\n"
+           "# TYPE peerpulse_task_seconds histogram\n";
+    task_seconds.render(out, "peerpulse_task_seconds");
+    return out;
+}
+
+bool MetricsExporter::start(uint16_t port) {
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        perror("metrics socket");
+        return false;
+    }
+
+    int opt = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+
+    if (bind(listen_fd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(listen_fd, 16) < 0 ||
+        (wake_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+        close(listen_fd);
+        listen_fd = -1;
+        return false;
+    }
+
+    running = true;
+    pthread_create(&thread, nullptr, &MetricsExporter::serve_thread_fn, this);
+    return true;
+}
+
+void MetricsExporter::stop() {
+    if (!running) {
+        return;
+    }
+    running = false;
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0) {
+        perror("metrics wake");
+    }
+    pthread_join(thread, nullptr);
+    close(listen_fd);
+    close(wake_fd);
+    listen_fd = -1;
+    wake_fd = -1;
+}
+
+void MetricsExporter::serve_loop() {
+    while (running) {
+        struct pollfd fds[2] = {{listen_fd, POLLIN, 0}, {wake_fd, POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("metrics poll");
+            return;
+        }
+        if (!running || !(fds[0].revents & POLLIN)) {
+            continue;
+        }
+
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        struct timeval timeout = {METRICS_IO_TIMEOUT_MS / 1000, (METRICS_IO_TIMEOUT_MS % 1000) * 1000};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        serve(fd);
+        close(fd);
+    }
+}
+
+void MetricsExporter::serve(int fd) {
+    // Read the request head, the body of a GET is empty
+    std::string request;
+    char buf[1024];
+    while (request.find("\r\n\r\n") == std::string::npos && request.size() < METRICS_REQUEST_SIZE) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0) {
+            return;
+        }
+        request.append(buf, n);
+    }
+
+    std::string body;
+    const char* status = "200 OK";
+    if (request.rfind("GET /metrics ", 0) == 0 || request.rfind("GET / ", 0) == 0) {
+        body = metrics.render();
+    } else {
+        status = "404 Not Found";
+        body = "Only GET /metrics is served\n";
+    }
+
+    std::string response = std::string("HTTP/1.1 ") + status + "\r\n"
+                           "Content-Type: text/plain; version=0.0.4\r\n"
+                           "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                           "Connection: close\r\n\r\n" + body;
+
+    size_t sent = 0;
+    while (sent < response.size()) {
+        ssize_t n = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return;
+        }
+        sent += n;
+    }
+}
@@ -0,0 +1,305 @@
+#include <protocol.h>
+#include <arpa/inet.h>
+#include <string.h>
+
+void put_u32(std::string& out, uint32_t value) {
+    uint32_t net_value = htonl(value);
+    out.append(reinterpret_cast<const char*>(&net_value), sizeof(net_value));
+}
+
+void put_u64(std::string& out, uint64_t value) {
+    put_u32(out, static_cast<uint32_t>(value >> 32));
+    put_u32(out, static_cast<uint32_t>(value));
+}
+
+uint32_t get_u32(const char* p) {
+    uint32_t net_value;
+    memcpy(&net_value, p, sizeof(net_value));
+    return ntohl(net_value);
+}
+
+uint64_t get_u64(const char* p) {
+    return (static_cast<uint64_t>(get_u32(p)) << 32) | get_u32(p + 4);
+}
+
+void encode_header(char* out, MsgType type, uint32_t length) {
+    uint32_t net_length = htonl(length);
+    memcpy(out, &net_length, sizeof(net_length));
+    out[4] = static_cast<char>(type);
+}
+
+std::string encode_frame(MsgType type, const char* payload, size_t length) {
+    std::string frame(FRAME_HEADER_SIZE, '\0');
+    encode_header(&frame[0], type, static_cast<uint32_t>(length));
+    frame.append(payload, length);
+    return frame;
+}
+
+std::string encode_task_range(const TaskRange& range) {
+    std::string payload;
+    put_u32(payload, range.task_id);
+    put_u64(payload, range.start);
+    put_u64(payload, range.end);
+    return payload;
+}
+
+bool decode_task_range(const std::string& payload, TaskRange& range) {
+    if (payload.size() != 20) {
+        return false;
+    }
+    range.task_id = get_u32(payload.data());
+    range.start = get_u64(payload.data() + 4);
+    range.end = get_u64(payload.data() + 12);
+    return range.start <= range.end;
+}
+
+std::string encode_done(const TaskDone& done) {
+    std::string payload;
+    put_u32(payload, done.task_id);
+    put_u32(payload, static_cast<uint32_t>(done.status));
+    put_u64(payload, done.bytes);
+    return payload;
+}
+
+bool decode_done(const std::string& payload, TaskDone& done) {
+    if (payload.size() != 16) {
+        return false;
+    }
+    done.task_id = get_u32(payload.data());
+    done.status = static_cast<int32_t>(get_u32(payload.data() + 4));
+    done.bytes = get_u64(payload.data() + 8);
+    return true;
+}
+
+std::string encode_payload_offer(const PayloadOffer& offer) {
+    std::string payload = offer.digest;
+    put_u64(payload, offer.size);
+    return payload;
+}
+
+bool decode_payload_offer(const std::string& payload, PayloadOffer& offer) {
+    if (payload.size() != DIGEST_SIZE + 8) {
+        return false;
+    }
+    offer.digest.assign(payload, 0, DIGEST_SIZE);
+    offer.size = get_u64(payload.data() + DIGEST_SIZE);
+    return true;
+}
+
+std::string encode_payload_status(const PayloadStatus& status) {
+    std::string payload = status.digest;
+    payload.push_back(status.cached ? 1 : 0);
+    return payload;
+}
+
+bool decode_payload_status(const std::string& payload, PayloadStatus& status) {
+    if (payload.size() != DIGEST_SIZE + 1) {
+        return false;
+    }
+    status.digest.assign(payload, 0, DIGEST_SIZE);
+    status.cached = payload[DIGEST_SIZE] != 0;
+    return true;
+}
+
+std::string encode_hello(const Hello& hello) {
+    std::string payload;
+    uint16_t net_port = htons(hello.relay_port);
+    uint16_t net_slots = htons(hello.slots);
+    payload.append(reinterpret_cast<const char*>(&net_port), sizeof(net_port));
+    payload.append(reinterpret_cast<const char*>(&net_slots), sizeof(net_slots));
+    put_u64(payload, hello.memory_bytes);
+    put_u32(payload, hello.score);
+    payload.push_back(static_cast<char>(hello.flags));
+    return payload;
+}
+
+bool decode_hello(const std::string& payload, Hello& hello) {
+    // Newer workers may append fields, only the prefix we know is read
+    if (payload.size() < 2) {
+        return false;
+    }
+    uint16_t net_port;
+    memcpy(&net_port, payload.data(), sizeof(net_port));
+    hello.relay_port = ntohs(net_port);
+
+    // Capacity fields came later, a relay port alone is still a valid HELLO
+    hello.slots = 1;
+    hello.memory_bytes = 0;
+    hello.score = 0;
+    hello.flags = payload.size() >= 17 ? static_cast<uint8_t>(payload[16]) : 0;
+    if (payload.size() >= 16) {
+        uint16_t net_slots;
+        memcpy(&net_slots, payload.data() + 2, sizeof(net_slots));
+        hello.slots = ntohs(net_slots) > 0 ? ntohs(net_slots) : 1;
+        hello.memory_bytes = get_u64(payload.data() + 4);
+        hello.score = get_u32(payload.data() + 12);
+    }
+    return true;
+}
+
+std::string encode_endpoints(const std::vector<Endpoint>& endpoints) {
+    std::string payload;
+    put_u32(payload, endpoints.size());
+    for (const Endpoint& endpoint : endpoints) {
+        uint16_t net_port = htons(endpoint.port);
+        payload.append(reinterpret_cast<const char*>(&endpoint.addr), sizeof(endpoint.addr));
+        payload.append(reinterpret_cast<const char*>(&net_port), sizeof(net_port));
+    }
+    return payload;
+}
+
+bool decode_endpoints(const std::string& payload, size_t offset, std::vector<Endpoint>& endpoints) {
+    if (payload.size() < offset + 4) {
+        return false;
+    }
+    uint32_t count = get_u32(payload.data() + offset);
+    offset += 4;
+    if (payload.size() - offset != static_cast<size_t>(count) * 6) {
+        return false;
+    }
+
+    endpoints.clear();
+    for (uint32_t i = 0; i < count; i++, offset += 6) {
+        Endpoint endpoint;
+        uint16_t net_port;
+        memcpy(&endpoint.addr, payload.data() + offset, sizeof(endpoint.addr));
+        memcpy(&net_port, payload.data() + offset + 4, sizeof(net_port));
+        endpoint.port = ntohs(net_port);
+        endpoints.push_back(endpoint);
+    }
+    return true;
+}
+
+std::string encode_relay_plan(const RelayPlan& plan) {
+    std::string payload(1, static_cast<char>(plan.fanout));
+    payload += encode_endpoints(plan.descendants);
+    return payload;
+}
+
+bool decode_relay_plan(const std::string& payload, RelayPlan& plan) {
+    if (payload.empty()) {
+        return false;
+    }
+    plan.fanout = static_cast<uint8_t>(payload[0]);
+    return plan.fanout > 0 && decode_endpoints(payload, 1, plan.descendants);
+}
+
+std::string encode_aggregate_plan(const AggregatePlan& plan) {
+    std::string payload(1, static_cast<char>(plan.op));
+    put_u32(payload, plan.k);
+    uint16_t net_port = htons(plan.parent.port);
+    payload.append(reinterpret_cast<const char*>(&plan.parent.addr), sizeof(plan.parent.addr));
+    payload.append(reinterpret_cast<const char*>(&net_port), sizeof(net_port));
+    return payload;
+}
+
+bool decode_aggregate_plan(const std::string& payload, AggregatePlan& plan) {
+    if (payload.size() != 11) {
+        return false;
+    }
+    uint16_t net_port;
+    plan.op = static_cast<uint8_t>(payload[0]);
+    plan.k = get_u32(payload.data() + 1);
+    memcpy(&plan.parent.addr, payload.data() + 5, sizeof(plan.parent.addr));
+    memcpy(&net_port, payload.data() + 9, sizeof(net_port));
+    plan.parent.port = ntohs(net_port);
+    return true;
+}
+
+std::vector<size_t> relay_subtree(size_t pos, size_t count, size_t fanout) {
+    std::vector<size_t> subtree;
+    size_t level_first = pos;
+    size_t level_last = pos;
+
+    // Each level of a heap subtree is one contiguous run of positions
+    while (1) {
+        level_first = fanout * level_first + 1;
+        level_last = fanout * level_last + fanout;
+        if (level_first > count) {
+            break;
+        }
+        for (size_t p = level_first; p <= level_last && p <= count; p++) {
+            subtree.push_back(p);
+        }
+    }
+    return subtree;
+}
+
+std::string digest_payload(const char* data, size_t size) {
+    PayloadHasher hasher;
+    hasher.update(data, size);
+    return hasher.digest();
+}
+
+std::string PayloadHasher::digest() {
+    boost::uuids::detail::sha1::digest_type words;
+    sha.get_digest(words);
+
+    std::string digest;
+    for (int i = 0; i < 5; i++) {
+        put_u32(digest, words[i]);
+    }
+    return digest;
+}
+
+std::string digest_hex(const std::string& digest) {
+    static const char hex[] = "0123456789abcdef";
+    std::string out;
+    for (unsigned char byte : digest) {
+        out.push_back(hex[byte >> 4]);
+        out.push_back(hex[byte & 0xf]);
+    }
+    return out;
+}
+
+void FrameReader::feed(const char* data, size_t length) {
+    // Compact once the consumed prefix dominates the buffer
+    if (off > 0 && off >= buf.size() / 2) {
+        buf.erase(0, off);
+        off = 0;
+    }
+    buf.append(data, length);
+}
+
+int FrameReader::next_header(MsgType& type, uint32_t& length) {
+    if (buf.size() - off < FRAME_HEADER_SIZE) {
+        return 0;
+    }
+
+    length = get_u32(buf.data() + off);
+    uint8_t raw_type = static_cast<uint8_t>(buf[off + 4]);
+    if (length > MAX_FRAME_SIZE || raw_type < static_cast<uint8_t>(MsgType::SCRIPT) ||
+        raw_type > static_cast<uint8_t>(LAST_MSG_TYPE)) {
+        return -1;
+    }
+
+    type = static_cast<MsgType>(raw_type);
+    off += FRAME_HEADER_SIZE;
+    return 1;
+}
+
+size_t FrameReader::take(char* out, size_t max) {
+    size_t size = buffered() < max ? buffered() : max;
+    memcpy(out, buf.data() + off, size);
+    off += size;
+    return size;
+}
+
+int FrameReader::next(Frame& frame) {
+    if (buf.size() - off < FRAME_HEADER_SIZE) {
+        return 0;
+    }
+
+    uint32_t length = get_u32(buf.data() + off);
+    if (length <= MAX_FRAME_SIZE && buf.size() - off < FRAME_HEADER_SIZE + length) {
+        return 0;
+    }
+
+    int status = next_header(frame.type, length);
+    if (status <= 0) {
+        return status;
+    }
+    frame.payload.assign(buf, off, length);
+    off += length;
+    return 1;
+}
@@ -0,0 +1,325 @@
+#include <range_cache.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <utime.h>
+#include <algorithm>
+#include <sys/stat.h>
+
+static bool make_dirs(const std::string& path) {
+    for (size_t pos = 1; pos <= path.size(); pos++) {
+        if (pos == path.size() || path[pos] == '/') {
+            std::string prefix = path.substr(0, pos);
+            if (mkdir(prefix.c_str(), 0755) < 0 && errno != EEXIST) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// "<start>-<end>.out", anything else in the directory is not ours
+static bool parse_entry(const char* name, uint64_t& start, uint64_t& end) {
+    unsigned long long s, e;
+    int used = 0;
+    if (sscanf(name, "%llu-%llu.out%n", &s, &e, &used) != 2 || name[used] != '\0' || e <= s) {
+        return false;
+    }
+    start = s;
+    end = e;
+    return true;
+}
+
+RangeCache::RangeCache() {
+    const char* home = getenv("HOME");
+    root = std::string(home ? home : "/tmp") + "/.cache/peerpulse/results";
+}
+
+RangeCache::~RangeCache() {
+    if (!started) {
+        return;
+    }
+    pthread_mutex_lock(&mutex);
+    stopping = true;
+    pthread_cond_signal(&work_cond);
+    pthread_mutex_unlock(&mutex);
+    pthread_join(thread, NULL);
+}
+
+std::string RangeCache::entry_path(uint64_t start, uint64_t end) const {
+    return dir + "/" + std::to_string(start) + "-" + std::to_string(end) + ".out";
+}
+
+bool RangeCache::select(const std::string& key) {
+    flush();
+    index.clear();
+    dir = root + "/" + key;
+    if (!make_dirs(dir)) {
+        perror(("Error creating result cache " + dir).c_str());
+        dir.clear();
+        return false;
+    }
+
+    DIR* listing = opendir(dir.c_str());
+    if (!listing) {
+        dir.clear();
+        return false;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(listing)) != nullptr) {
+        uint64_t start, end;
+        struct stat st;
+        if (parse_entry(entry->d_name, start, end) && stat((dir + "/" + entry->d_name).c_str(), &st) == 0) {
+            index.insert(start, end, st.st_size);
+        }
+    }
+    closedir(listing);
+
+    if (!started) {
+        started = pthread_create(&thread, NULL, store_thread_fn, this) == 0;
+    }
+    return true;
+}
+
+std::vector<CachedRange> RangeCache::cover(uint64_t start, uint64_t end) {
+    std::vector<CachedRange> candidates;
+    index.overlapping(start, end, [&](uint64_t s, uint64_t e, uint64_t bytes) {
+        if (s >= start && e <= end) {
+            candidates.push_back({s, e, bytes, entry_path(s, e)});
+        }
+    });
+
+    // Weighted interval scheduling, items covered is the weight. best[j] is
+    // the most the first j candidates by end can cover without overlapping.
+    std::sort(candidates.begin(), candidates.end(),
+              [](const CachedRange& a, const CachedRange& b) { return a.end < b.end; });
+    size_t n = candidates.size();
+    std::vector<uint64_t> best(n + 1, 0);
+    std::vector<size_t> fits(n);
+    for (size_t j = 0; j < n; j++) {
+        // Candidates ending at or before this one starts
+        fits[j] = std::upper_bound(candidates.begin(), candidates.begin() + j, candidates[j].start,
+                                   [](uint64_t s, const CachedRange& c) { return s < c.end; }) - candidates.begin();
+        best[j + 1] = std::max(best[j], best[fits[j]] + (candidates[j].end - candidates[j].start));
+    }
+
+    std::vector<CachedRange> chosen;
+    for (size_t j = n; j > 0;) {
+        if (best[j] == best[j - 1]) {
+            j--;
+        } else {
+            chosen.push_back(candidates[j - 1]);
+            j = fits[j - 1];
+        }
+    }
+    std::reverse(chosen.begin(), chosen.end());
+
+    // Touching the file marks it as recently used
+    for (const CachedRange& range : chosen) {
+        utime(range.path.c_str(), nullptr);
+    }
+    return chosen;
+}
+
+void RangeCache::store(uint64_t start, uint64_t end, std::string&& data) {
+    if (!started || dir.empty() || end <= start || index.contains(start, end)) {
+        return;
+    }
+
+    uint64_t size = data.size();
+    pthread_mutex_lock(&mutex);
+    if (queued_bytes + size > RESULT_CACHE_QUEUE_BYTES) {
+        pthread_mutex_unlock(&mutex);
+        return;
+    }
+    queued_bytes += size;
+    Store entry;
+    entry.start = start;
+    entry.end = end;
+    entry.size = size;
+    entry.data = std::move(data);
+    entry.dir = dir;
+    queue.push_back(std::move(entry));
+    pthread_cond_signal(&work_cond);
+    pthread_mutex_unlock(&mutex);
+
+    index.insert(start, end, size);
+}
+
+void RangeCache::store(uint64_t start, uint64_t end, int fd, uint64_t size) {
+    if (!started || dir.empty() || end <= start || index.contains(start, end)) {
+        close(fd);
+        return;
+    }
+
+    Store entry;
+    entry.start = start;
+    entry.end = end;
+    entry.fd = fd;
+    entry.size = size;
+    entry.dir = dir;
+
+    pthread_mutex_lock(&mutex);
+    queue.push_back(std::move(entry));
+    pthread_cond_signal(&work_cond);
+    pthread_mutex_unlock(&mutex);
+
+    index.insert(start, end, size);
+}
+
+void RangeCache::forget(uint64_t start, uint64_t end) {
+    if (dir.empty()) {
+        return;
+    }
+    index.erase(start, end);
+    unlink(entry_path(start, end).c_str());
+}
+
+void RangeCache::flush() {
+    pthread_mutex_lock(&mutex);
+    while (!queue.empty() || busy) {
+        pthread_cond_wait(&idle_cond, &mutex);
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+void RangeCache::store_loop() {
+    pthread_mutex_lock(&mutex);
+    while (1) {
+        while (queue.empty() && !stopping) {
+            pthread_cond_wait(&work_cond, &mutex);
+        }
+        if (queue.empty()) {
+            break;
+        }
+
+        Store entry = std::move(queue.front());
+        queue.pop_front();
+        busy = true;
+        pthread_mutex_unlock(&mutex);
+
+        write_entry(entry);
+
+        pthread_mutex_lock(&mutex);
+        queued_bytes -= entry.data.size();
+        busy = false;
+        if (queue.empty()) {
+            pthread_cond_broadcast(&idle_cond);
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+// Written under a temporary name and renamed, a crash never leaves a short entry
+void RangeCache::write_entry(Store& entry) {
+    std::string name = std::to_string(entry.start) + "-" + std::to_string(entry.end);
+    std::string path = entry.dir + "/" + name + ".out";
+    std::string tmp = entry.dir + "/." + name + ".tmp";
+
+    int out = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool ok = out >= 0;
+
+    if (ok && entry.fd < 0) {
+        const char* p = entry.data.data();
+        size_t left = entry.data.size();
+        while (ok && left > 0) {
+            ssize_t n = write(out, p, left);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            ok = n > 0;
+            p += n > 0 ? n : 0;
+            left -= n > 0 ? n : 0;
+        }
+    } else if (ok) {
+        char buf[64 * 1024];
+        off_t offset = 0;
+        while (ok && static_cast<uint64_t>(offset) < entry.size) {
+            ssize_t n = pread(entry.fd, buf, sizeof(buf), offset);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            ok = n > 0 && write(out, buf, n) == n;
+            offset += n > 0 ? n : 0;
+        }
+    }
+    if (entry.fd >= 0) {
+        close(entry.fd);
+    }
+
+    if (out >= 0) {
+        ok = close(out) == 0 && ok;
+    }
+    if (!ok || rename(tmp.c_str(), path.c_str()) < 0) {
+        perror(("Error caching " + path).c_str());
+        unlink(tmp.c_str());
+    }
+}
+
+void RangeCache::trim() {
+    struct Entry {
+        time_t used;
+        uint64_t bytes;
+        std::string path;
+    };
+
+    flush();
+    std::vector<Entry> entries;
+    uint64_t total = 0;
+
+    DIR* keys = opendir(root.c_str());
+    if (!keys) {
+        return;
+    }
+    struct dirent* key;
+    while ((key = readdir(keys)) != nullptr) {
+        if (key->d_name[0] == '.') {
+            continue;
+        }
+        std::string key_dir = root + "/" + key->d_name;
+        DIR* listing = opendir(key_dir.c_str());
+        if (!listing) {
+            continue;
+        }
+        struct dirent* file;
+        while ((file = readdir(listing)) != nullptr) {
+            uint64_t start, end;
+            struct stat st;
+            std::string path = key_dir + "/" + file->d_name;
+            if (parse_entry(file->d_name, start, end) && stat(path.c_str(), &st) == 0) {
+                entries.push_back({st.st_mtime, static_cast<uint64_t>(st.st_size), path});
+                total += st.st_size;
+            }
+        }
+        closedir(listing);
+    }
+    closedir(keys);
+
+    if (total <= max_bytes) {
+        return;
+    }
+
+    // Oldest first
+    std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.used < b.used; });
+    bool selected_changed = false;
+    for (const Entry& entry : entries) {
+        if (total <= max_bytes) {
+            break;
+        }
+        if (unlink(entry.path.c_str()) == 0) {
+            total -= entry.bytes;
+            std::string key_dir = entry.path.substr(0, entry.path.rfind('/'));
+            selected_changed |= key_dir == dir;
+            rmdir(key_dir.c_str());     // Only goes once the key has nothing left
+        }
+    }
+
+    if (selected_changed) {
+        std::string key = dir.substr(root.size() + 1);
+        select(key);
+    }
+}
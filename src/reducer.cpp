@@ -0,0 +1,309 @@
+#include <reducer.h>
+#include <protocol.h>
+#include <algorithm>
+#include <functional>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef std::greater<std::pair<double, uint64_t>> SmallestOnTop;
+
+bool parse_reduce(const std::string& spec, ReduceOp& op, size_t& k) {
+    if (spec == "concat") {
+        op = ReduceOp::CONCAT;
+    } else if (spec == "sum") {
+        op = ReduceOp::SUM;
+    } else if (spec == "min") {
+        op = ReduceOp::MIN;
+    } else if (spec == "max") {
+        op = ReduceOp::MAX;
+    } else if (spec == "histogram") {
+        op = ReduceOp::HISTOGRAM;
+    } else if (spec.rfind("topk:", 0) == 0) {
+        char* end;
+        long value = strtol(spec.c_str() + strlen("topk:"), &end, 10);
+        if (*end != '\0' || value <= 0) {
+            return false;
+        }
+        op = ReduceOp::TOPK;
+        k = static_cast<size_t>(value);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+const char* reduce_name(ReduceOp op) {
+    switch (op) {
+        case ReduceOp::SUM: return "sum";
+        case ReduceOp::MIN: return "min";
+        case ReduceOp::MAX: return "max";
+        case ReduceOp::TOPK: return "topk";
+        case ReduceOp::HISTOGRAM: return "histogram";
+        default: return "concat";
+    }
+}
+
+void ResultReducer::configure(ReduceOp op, size_t k) {
+    this->op = op;
+    this->k = k > 0 ? k : 1;
+}
+
+void ResultReducer::reset() {
+    total = Partial();
+    staging.clear();
+    stray_bytes = 0;
+}
+
+void ResultReducer::fold(Partial& partial, uint64_t key, double value) const {
+    switch (op) {
+        case ReduceOp::SUM:
+            partial.value += value;
+            break;
+        case ReduceOp::MIN:
+        case ReduceOp::MAX:
+            if (partial.count == 0 || (op == ReduceOp::MIN ? value < partial.value : value > partial.value)) {
+                partial.value = value;
+                partial.key = key;
+            }
+            break;
+        case ReduceOp::TOPK:
+            if (partial.top.size() < k || value > partial.top.front().first) {
+                partial.top.emplace_back(value, key);
+                std::push_heap(partial.top.begin(), partial.top.end(), SmallestOnTop());
+                if (partial.top.size() > k) {
+                    std::pop_heap(partial.top.begin(), partial.top.end(), SmallestOnTop());
+                    partial.top.pop_back();
+                }
+            }
+            break;
+        case ReduceOp::HISTOGRAM:
+            partial.bins[key] += value;
+            break;
+        default:
+            return;
+    }
+    partial.count++;
+}
+
+void ResultReducer::merge(Partial& into, const Partial& from) const {
+    if (from.count == 0) {
+        return;
+    }
+
+    switch (op) {
+        case ReduceOp::SUM:
+            into.value += from.value;
+            into.count += from.count;
+            break;
+        case ReduceOp::MIN:
+        case ReduceOp::MAX:
+            if (into.count == 0 || (op == ReduceOp::MIN ? from.value < into.value : from.value > into.value)) {
+                into.value = from.value;
+                into.key = from.key;
+            }
+            into.count += from.count;
+            break;
+        case ReduceOp::TOPK: {
+            uint64_t count = into.count + from.count;
+            for (const auto& entry : from.top) {
+                fold(into, entry.second, entry.first);
+            }
+            into.count = count;
+            break;
+        }
+        case ReduceOp::HISTOGRAM:
+            for (const auto& bin : from.bins) {
+                into.bins[bin.first] += bin.second;
+            }
+            into.count += from.count;
+            break;
+        default:
+            break;
+    }
+}
+
+void ResultReducer::begin(uint32_t attempt) {
+    staging[attempt] = Attempt();
+}
+
+void ResultReducer::append(uint32_t attempt, const char* data, size_t len) {
+    auto it = staging.find(attempt);
+    if (it == staging.end()) {
+        return;
+    }
+    Attempt& a = it->second;
+
+    // Finish a record the previous chunk started
+    if (!a.tail.empty()) {
+        size_t need = std::min(REDUCE_RECORD_SIZE - a.tail.size(), len);
+        a.tail.append(data, need);
+        data += need;
+        len -= need;
+        if (a.tail.size() < REDUCE_RECORD_SIZE) {
+            return;
+        }
+        uint64_t bits = get_u64(a.tail.data() + 8);
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        fold(a.partial, get_u64(a.tail.data()), value);
+        a.tail.clear();
+    }
+
+    for (; len >= REDUCE_RECORD_SIZE; data += REDUCE_RECORD_SIZE, len -= REDUCE_RECORD_SIZE) {
+        uint64_t bits = get_u64(data + 8);
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        fold(a.partial, get_u64(data), value);
+    }
+    a.tail.assign(data, len);
+}
+
+Partial ResultReducer::commit(uint32_t attempt) {
+    auto it = staging.find(attempt);
+    if (it == staging.end()) {
+        return Partial();
+    }
+    merge(total, it->second.partial);
+    stray_bytes += it->second.tail.size();
+    Partial committed = std::move(it->second.partial);
+    staging.erase(it);
+    return committed;
+}
+
+void ResultReducer::abort(uint32_t attempt) {
+    staging.erase(attempt);
+}
+
+Partial ResultReducer::take() {
+    Partial taken;
+    std::swap(taken, total);
+    return taken;
+}
+
+static void put_f64(std::string& out, double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    put_u64(out, bits);
+}
+
+static double get_f64(const char* p) {
+    uint64_t bits = get_u64(p);
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+std::string encode_partial_batch(const std::vector<uint32_t>& task_ids, const Partial& partial) {
+    std::string payload;
+    put_u32(payload, task_ids.size());
+    for (uint32_t id : task_ids) {
+        put_u32(payload, id);
+    }
+
+    put_u64(payload, partial.count);
+    put_f64(payload, partial.value);
+    put_u64(payload, partial.key);
+    put_u32(payload, partial.top.size());
+    for (const auto& entry : partial.top) {
+        put_f64(payload, entry.first);
+        put_u64(payload, entry.second);
+    }
+    put_u32(payload, partial.bins.size());
+    for (const auto& bin : partial.bins) {
+        put_u64(payload, bin.first);
+        put_f64(payload, bin.second);
+    }
+    return payload;
+}
+
+bool decode_partial_batch(const std::string& payload, std::vector<uint32_t>& task_ids, Partial& partial) {
+    const char* p = payload.data();
+    size_t left = payload.size();
+
+    if (left < 4) {
+        return false;
+    }
+    uint32_t ids = get_u32(p);
+    p += 4;
+    left -= 4;
+    if (left < static_cast<uint64_t>(ids) * 4 + 28) {
+        return false;
+    }
+    task_ids.resize(ids);
+    for (uint32_t i = 0; i < ids; i++, p += 4) {
+        task_ids[i] = get_u32(p);
+    }
+    left -= static_cast<size_t>(ids) * 4;
+
+    partial = Partial();
+    partial.count = get_u64(p);
+    partial.value = get_f64(p + 8);
+    partial.key = get_u64(p + 16);
+    uint32_t top = get_u32(p + 24);
+    p += 28;
+    left -= 28;
+    if (left < static_cast<uint64_t>(top) * 16 + 4) {
+        return false;
+    }
+    // Only ever read back through merge(), which keeps its own heap
+    for (uint32_t i = 0; i < top; i++, p += 16) {
+        partial.top.emplace_back(get_f64(p), get_u64(p + 8));
+    }
+    left -= static_cast<size_t>(top) * 16;
+
+    uint32_t bins = get_u32(p);
+    p += 4;
+    left -= 4;
+    if (left != static_cast<uint64_t>(bins) * 16) {
+        return false;
+    }
+    for (uint32_t i = 0; i < bins; i++, p += 16) {
+        partial.bins[get_u64(p)] += get_f64(p + 8);
+    }
+    return true;
+}
+
+std::string ResultReducer::render() const {
+    std::string out;
+    char line[96];
+
+    switch (op) {
+        case ReduceOp::SUM:
+            snprintf(line, sizeof(line), "sum %.17g\ncount %llu\n", total.value,
+                     static_cast<unsigned long long>(total.count));
+            out += line;
+            break;
+        case ReduceOp::MIN:
+        case ReduceOp::MAX:
+            if (total.count > 0) {
+                snprintf(line, sizeof(line), "%s %.17g\nkey %llu\n", reduce_name(op), total.value,
+                         static_cast<unsigned long long>(total.key));
+                out += line;
+            }
+            snprintf(line, sizeof(line), "count %llu\n", static_cast<unsigned long long>(total.count));
+            out += line;
+            break;
+        case ReduceOp::TOPK: {
+            // Largest first
+            std::vector<std::pair<double, uint64_t>> top = total.top;
+            std::sort(top.begin(), top.end(), SmallestOnTop());
+            for (const auto& entry : top) {
+                snprintf(line, sizeof(line), "%llu %.17g\n", static_cast<unsigned long long>(entry.second),
+                         entry.first);
+                out += line;
+            }
+            break;
+        }
+        case ReduceOp::HISTOGRAM:
+            for (const auto& bin : total.bins) {
+                snprintf(line, sizeof(line), "%llu %.17g\n", static_cast<unsigned long long>(bin.first),
+                         bin.second);
+                out += line;
+            }
+            break;
+        default:
+            break;
+    }
+    return out;
+}
@@ -0,0 +1,415 @@
+#include <scheduler.h>
+#include <algorithm>
+
+// Weight of the newest sample in the smoothed rate
+constexpr double RATE_SMOOTHING = 0.5;
+
+// Guided self-scheduling hands a slot at most its share of unassigned / factor
+constexpr uint64_t GUIDED_FACTOR = 2;
+
+// Until a worker has a measured rate it gets a fraction of the guided size
+constexpr uint64_t PROBE_DIVISOR = 4;
+
+// A task may take this many times its expected duration before it is overdue
+constexpr double DEADLINE_FACTOR = 10.0;
+
+// Completed tasks needed before the median is trusted to spot stragglers
+constexpr size_t MIN_BACKUP_SAMPLES = 3;
+
+// Tasks younger than this are never backed up, however small they are
+constexpr double MIN_BACKUP_SECONDS = 1.0;
+
+void TaskQueue::reset(uint64_t total, const std::vector<int>& workers) {
+    reservations.clear();
+    orphans.clear();
+    in_flight.clear();
+    twins.clear();
+    item_seconds.clear();
+    unfinished = total;
+    departed_items = 0;
+    steals = 0;
+    requeues = 0;
+    backups = 0;
+    abandoned_items = 0;
+
+    // Rates carry over from earlier jobs, the chunk sizes do not
+    for (auto& entry : rates) {
+        entry.second.last_chunk = 0;
+        entry.second.items_done = 0;
+    }
+
+    if (workers.empty()) {
+        if (total > 0) {
+            orphans.push_back({0, total, 0});
+        }
+        return;
+    }
+
+    // Shares in proportion to capacity, the last worker takes the rounding
+    double mean = mean_score();
+    double weights = 0;
+    for (int worker : workers) {
+        weights += capacity(worker, mean);
+    }
+    uint64_t start = 0;
+    double covered = 0;
+
+    for (size_t i = 0; i < workers.size(); i++) {
+        covered += capacity(workers[i], mean);
+        uint64_t end = i + 1 == workers.size() ? total : static_cast<uint64_t>(total * (covered / weights));
+        end = std::min(std::max(end, start), total);
+        reservations[workers[i]] = {start, end, 0};
+        start = end;
+    }
+}
+
+void TaskQueue::set_capacity(int worker, uint32_t slots, uint32_t score) {
+    WorkerRate& rate = rates[worker];
+    rate.slots = slots > 0 ? slots : 1;
+    rate.score = score;
+}
+
+double TaskQueue::mean_score() const {
+    // Scores only mean something relative to each other
+    double scores = 0;
+    size_t scored = 0;
+    for (const auto& entry : rates) {
+        if (entry.second.score > 0) {
+            scores += entry.second.score;
+            scored++;
+        }
+    }
+    return scored > 0 ? scores / scored : 0;
+}
+
+double TaskQueue::capacity(int worker, double mean) const {
+    auto it = rates.find(worker);
+    if (it == rates.end()) {
+        return 1;
+    }
+    double speed = it->second.score > 0 && mean > 0 ? it->second.score / mean : 1;
+    return it->second.slots * speed;
+}
+
+double TaskQueue::total_capacity(double mean) const {
+    double total = 0;
+    for (const auto& entry : reservations) {
+        total += capacity(entry.first, mean);
+    }
+    return total > 0 ? total : 1;
+}
+
+uint64_t TaskQueue::unassigned() const {
+    uint64_t total = 0;
+    for (const auto& entry : reservations) {
+        total += entry.second.size();
+    }
+    for (const Reservation& orphan : orphans) {
+        total += orphan.size();
+    }
+    return total;
+}
+
+uint64_t TaskQueue::choose_size(int worker) const {
+    auto it = rates.find(worker);
+    double mean = mean_score();
+    double slot_share = capacity(worker, mean) / (it == rates.end() ? 1 : it->second.slots) / total_capacity(mean);
+    uint64_t guided = static_cast<uint64_t>(unassigned() * slot_share / GUIDED_FACTOR);
+    uint64_t size;
+
+    if (it == rates.end() || it->second.items_per_sec <= 0) {
+        size = guided / PROBE_DIVISOR;
+    } else {
+        size = static_cast<uint64_t>(it->second.items_per_sec * target_seconds);
+        if (size > guided) {
+            size = guided;
+        }
+    }
+
+    return size < min_chunk ? min_chunk : size;
+}
+
+bool TaskQueue::steal(int worker) {
+    // Anything a departed worker left behind goes first
+    if (!orphans.empty()) {
+        reservations[worker] = orphans.back();
+        orphans.pop_back();
+        return true;
+    }
+
+    auto victim = reservations.end();
+    for (auto it = reservations.begin(); it != reservations.end(); ++it) {
+        if (it->first != worker && (victim == reservations.end() || it->second.size() > victim->second.size())) {
+            victim = it;
+        }
+    }
+    if (victim == reservations.end() || victim->second.size() == 0) {
+        return false;
+    }
+
+    // Take the back half, the victim keeps working from its front. A victim
+    // with a single item left gives it up entirely.
+    Reservation& from = victim->second;
+    uint64_t take = from.size() > 1 ? from.size() / 2 : from.size();
+    reservations[worker] = {from.end - take, from.end, from.retries};
+    from.end -= take;
+    steals++;
+    return true;
+}
+
+bool TaskQueue::next(int worker, Task& task) {
+    auto it = reservations.find(worker);
+    if (it == reservations.end() || it->second.size() == 0) {
+        if (!steal(worker)) {
+            return false;
+        }
+        it = reservations.find(worker);
+    }
+
+    uint64_t size = choose_size(worker);
+    Reservation& own = it->second;
+    if (size > own.size()) {
+        size = own.size();
+    }
+
+    task.id = next_id++;
+    task.start = own.start;
+    task.end = own.start + size;
+    task.retries = own.retries;
+    own.start += size;
+
+    in_flight[task.id] = {task, worker, clock::now()};
+    rates[worker].last_chunk = size;
+    return true;
+}
+
+double TaskQueue::median_item_seconds() const {
+    if (item_seconds.size() < MIN_BACKUP_SAMPLES) {
+        return 0;
+    }
+    std::vector<double> samples(item_seconds);
+    std::nth_element(samples.begin(), samples.begin() + samples.size() / 2, samples.end());
+    return samples[samples.size() / 2];
+}
+
+bool TaskQueue::speculate(int worker, Task& task) {
+    double per_item = median_item_seconds();
+    if (backup_factor <= 0 || per_item <= 0) {
+        return false;
+    }
+
+    // The task furthest behind what the median predicts for its size
+    clock::time_point now = clock::now();
+    auto straggler = in_flight.end();
+    double worst = backup_factor;
+    for (auto it = in_flight.begin(); it != in_flight.end(); ++it) {
+        const InFlight& running = it->second;
+        if (running.worker == worker || twins.count(it->first)) {
+            continue;
+        }
+
+        double elapsed = std::chrono::duration<double>(now - running.started).count();
+        double expected = per_item * (running.task.end - running.task.start);
+        if (elapsed >= MIN_BACKUP_SECONDS && elapsed > worst * expected) {
+            worst = elapsed / expected;
+            straggler = it;
+        }
+    }
+    if (straggler == in_flight.end()) {
+        return false;
+    }
+
+    uint32_t original = straggler->first;
+    task = straggler->second.task;
+    task.id = next_id++;
+    twins[task.id] = original;
+    twins[original] = task.id;
+
+    in_flight[task.id] = {task, worker, now};
+    rates[worker].last_chunk = task.end - task.start;
+    backups++;
+    return true;
+}
+
+bool TaskQueue::twin_of(uint32_t task_id, uint32_t& twin) const {
+    auto it = twins.find(task_id);
+    if (it == twins.end()) {
+        return false;
+    }
+    twin = it->second;
+    return true;
+}
+
+void TaskQueue::withdraw(uint32_t task_id) {
+    auto it = twins.find(task_id);
+    if (it == twins.end()) {
+        return;
+    }
+    twins.erase(it->second);
+    twins.erase(it);
+    in_flight.erase(task_id);
+}
+
+double TaskQueue::complete(uint32_t task_id) {
+    auto it = in_flight.find(task_id);
+    if (it == in_flight.end()) {
+        return -1;
+    }
+
+    // The slower copy is not needed anymore
+    uint32_t twin;
+    if (twin_of(task_id, twin)) {
+        withdraw(twin);
+    }
+
+    const InFlight& done = it->second;
+    uint64_t items = done.task.end - done.task.start;
+    double elapsed = std::chrono::duration<double>(clock::now() - done.started).count();
+
+    WorkerRate& rate = rates[done.worker];
+    rate.items_done += items;
+    if (elapsed > 0 && items > 0) {
+        item_seconds.push_back(elapsed / items);
+
+        double sample = items / elapsed;
+        rate.items_per_sec = rate.items_per_sec <= 0 ? sample :
+            RATE_SMOOTHING * sample + (1 - RATE_SMOOTHING) * rate.items_per_sec;
+    }
+
+    unfinished -= items;
+    in_flight.erase(it);
+    return elapsed;
+}
+
+void TaskQueue::abandon(uint32_t task_id) {
+    auto it = in_flight.find(task_id);
+    if (it == in_flight.end()) {
+        return;
+    }
+    unfinished -= it->second.task.end - it->second.task.start;
+    abandoned_items += it->second.task.end - it->second.task.start;
+    in_flight.erase(it);
+}
+
+bool TaskQueue::requeue(uint32_t task_id) {
+    auto it = in_flight.find(task_id);
+    if (it == in_flight.end()) {
+        return false;
+    }
+
+    const Task& task = it->second.task;
+    if (task.retries >= max_retries) {
+        abandon(task_id);
+        return false;
+    }
+
+    // steal() takes orphans from the back, so this goes out next
+    orphans.push_back({task.start, task.end, task.retries + 1});
+    in_flight.erase(it);
+    requeues++;
+    return true;
+}
+
+void TaskQueue::skip(uint64_t start, uint64_t end) {
+    // Reservations are disjoint, each loses its overlap and may split in two
+    std::vector<Reservation> rest;
+    for (auto& entry : reservations) {
+        Reservation& r = entry.second;
+        uint64_t from = std::max(r.start, start);
+        uint64_t to = std::min(r.end, end);
+        if (from >= to) {
+            continue;
+        }
+        unfinished -= to - from;
+        if (to < r.end) {
+            rest.push_back({to, r.end, r.retries});
+        }
+        r.end = from;
+    }
+
+    std::vector<Reservation> kept;
+    for (const Reservation& r : orphans) {
+        uint64_t from = std::max(r.start, start);
+        uint64_t to = std::min(r.end, end);
+        if (from >= to) {
+            kept.push_back(r);
+            continue;
+        }
+        unfinished -= to - from;
+        if (r.start < from) {
+            kept.push_back({r.start, from, r.retries});
+        }
+        if (to < r.end) {
+            kept.push_back({to, r.end, r.retries});
+        }
+    }
+    kept.insert(kept.end(), rest.begin(), rest.end());
+    orphans.swap(kept);
+}
+
+bool TaskQueue::range_of(uint32_t task_id, Task& task) const {
+    auto it = in_flight.find(task_id);
+    if (it == in_flight.end()) {
+        return false;
+    }
+    task = it->second.task;
+    return true;
+}
+
+void TaskQueue::redo(uint64_t start, uint64_t end) {
+    if (end <= start) {
+        return;
+    }
+    orphans.push_back({start, end, 0});
+    unfinished += end - start;
+    requeues++;
+}
+
+std::vector<uint32_t> TaskQueue::overdue() const {
+    std::vector<uint32_t> late;
+    clock::time_point now = clock::now();
+
+    for (const auto& entry : in_flight) {
+        const InFlight& running = entry.second;
+        uint64_t items = running.task.end - running.task.start;
+
+        // Expected duration at the worker's rate, or a whole target slot before it has one
+        double expected = target_seconds;
+        auto rate = rates.find(running.worker);
+        if (rate != rates.end() && rate->second.items_per_sec > 0) {
+            expected = items / rate->second.items_per_sec;
+        }
+
+        double deadline = std::max(min_timeout, DEADLINE_FACTOR * expected);
+        if (std::chrono::duration<double>(now - running.started).count() > deadline) {
+            late.push_back(entry.first);
+        }
+    }
+    return late;
+}
+
+uint64_t TaskQueue::items_done() const {
+    uint64_t total = departed_items;
+    for (const auto& entry : rates) {
+        total += entry.second.items_done;
+    }
+    return total;
+}
+
+void TaskQueue::remove_worker(int worker) {
+    // A later worker on the same fd starts from the default rate, what it
+    // got through stays in the job's total
+    auto rate = rates.find(worker);
+    if (rate != rates.end()) {
+        departed_items += rate->second.items_done;
+        rates.erase(rate);
+    }
+    auto it = reservations.find(worker);
+    if (it == reservations.end()) {
+        return;
+    }
+    if (it->second.size() > 0) {
+        orphans.push_back(it->second);
+    }
+    reservations.erase(it);
+}
@@ -9,15 +9,45 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <net/if.h> 
 #include <string.h>
 #include <utility>
+#include <algorithm>
 #include <fcntl.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-PeerServer::PeerServer(TUI &interface) : interface(interface) {
-    // Set up the TUI to monitor our client list
-    interface.set_server_ref(this, &_clients_mutex, &_clients_cond, &_clients);
+// epoll user data tags for the two non-client fds
+static constexpr uint64_t LISTEN_TAG = UINT64_MAX;
+static constexpr uint64_t WAKE_TAG = UINT64_MAX - 1;
+
+constexpr size_t RECV_BUF_SIZE = 4096*10;
+constexpr int MAX_EVENTS = 256;
+
+static uint64_t monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+PeerServer::PeerServer(EventSink &events) : events(events) {
+    _recv_buf = new char[RECV_BUF_SIZE];
+}
+
+PeerServer::~PeerServer() {
+    results.close();
+    delete[] _recv_buf;
+    if (_script_buf) {
+        munmap(const_cast<char*>(_script_buf), file_size);
+    }
+    if (script_fd >= 0) {
+        close(script_fd);
+    }
 }
 
 void PeerServer::set_item_count(int item_count) {
@@ -28,59 +58,59 @@ int PeerServer::get_item_count() {
         return item_count;
 }
 
-void PeerServer::addFile(std::string& file_name) {
-    // Use binary mode and check for errors
-    FILE* file = fopen(file_name.c_str(), "rb");
-    if (!file) {
+bool PeerServer::addFile(std::string& file_name) {
+    int fd = open(file_name.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
         perror(("Error opening file: " + file_name).c_str());
-        return;
+        return false;
     }
 
-    // Get file size properly
-    fseek(file, 0, SEEK_END);
-    file_size = ftell(file);
-    rewind(file);  // Important: reset file position to start
-    
-    if (file_size <= 0) {
-        fclose(file);
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+        close(fd);
         fprintf(stderr, "Invalid file size or unable to determine size\n");
-        return;
+        return false;
     }
 
-    // Allocate buffer (+1 for null terminator if needed)
-    char* buffer = new char[file_size + 1];
-    
-    // Read file content with proper error checking
-    size_t bytes_read = fread(buffer, 1, file_size, file);
-    if (bytes_read != static_cast<size_t>(file_size)) {
-        if (feof(file)) {
-            fprintf(stderr, "Unexpected end of file\n");
-        } else if (ferror(file)) {
-            perror("Error reading file");
-        }
-        
-        delete[] buffer;
-        fclose(file);
-        return;
+    // The whole payload travels as one SCRIPT frame, whose length is 32 bits
+    // and which workers refuse past MAX_FRAME_SIZE
+    if (static_cast<uint64_t>(st.st_size) > MAX_FRAME_SIZE) {
+        close(fd);
+        fprintf(stderr, "%s is %llu bytes, payloads are limited to %u bytes\n", file_name.c_str(),
+                static_cast<unsigned long long>(st.st_size), MAX_FRAME_SIZE);
+        return false;
     }
 
-    // Null-terminate if treating as string
-    buffer[file_size] = '\0';
-    
-    // Handle the buffer (assuming _script_buf is a class member)
-    delete[] _script_buf;  // Clean up previous allocation if any
-    _script_buf = buffer;
-    
-    fclose(file);
+    // Map the payload once. Workers are fed from the page cache with
+    // sendfile(), the mapping only backs the script viewer.
+    void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("Error mapping file");
+        close(fd);
+        return false;
+    }
+
+    // Clean up previous payload if any
+    if (_script_buf) {
+        munmap(const_cast<char*>(_script_buf), file_size);
+    }
+    if (script_fd >= 0) {
+        close(script_fd);
+    }
+
+    script_fd = fd;
+    file_size = st.st_size;
+    _script_buf = static_cast<const char*>(map);
+    payload_digest = digest_payload(_script_buf, file_size);
+    return true;
 }
 
 int PeerServer::start_socket() {
     struct sockaddr_in address;
     int opt = 1;
-    int addrlen = sizeof(address);
     
     // Create socket file descriptor
-    if ((sock_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    if ((sock_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
         perror("socket failed");
         exit(EXIT_FAILURE);
     }
@@ -102,190 +132,1357 @@ int PeerServer::start_socket() {
         exit(EXIT_FAILURE);
     }
     
-    // Start listening
-    if (listen(sock_fd, 5) < 0) {
+    // Start listening, hundreds of workers may connect at once
+    if (listen(sock_fd, SOMAXCONN) < 0) {
         perror("listen failed");
         exit(EXIT_FAILURE);
     }
 
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+        (wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        perror("epoll setup failed");
+        exit(EXIT_FAILURE);
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = LISTEN_TAG;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock_fd, &ev);
+    ev.data.u64 = WAKE_TAG;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+
+    struct epoll_event events[MAX_EVENTS];
+    uint64_t next_check = monotonic_ms() + HEARTBEAT_INTERVAL_MS;
+
+    while (running) {
+        // Wake up at least once per heartbeat interval to check on workers
+        uint64_t now = monotonic_ms();
+        int timeout = next_check > now ? static_cast<int>(next_check - now) : 0;
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait failed");
+            break;
+        }
+
+        pthread_mutex_lock(&_clients_mutex);
+        for (int i = 0; i < n; i++) {
+            uint64_t tag = events[i].data.u64;
+
+            if (tag == LISTEN_TAG) {
+                handle_accept();
+            } else if (tag == WAKE_TAG) {
+                uint64_t count;
+                while (read(wake_fd, &count, sizeof(count)) > 0) {}
+
+                // send_files() queued output, try to push it out right away
+                for (size_t c = 0; c < _clients.size(); c++) {
+                    if (!_clients[c].closed && _clients[c].has_pending()) {
+                        handle_writable(c);
+                    }
+                }
+            } else {
+                size_t index = static_cast<size_t>(tag);
+                if (index >= _clients.size() || _clients[index].closed) {
+                    continue;
+                }
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                    handle_readable(index);
+                }
+                if (!_clients[index].closed && (events[i].events & EPOLLOUT)) {
+                    handle_writable(index);
+                }
+            }
+        }
+
+        now = monotonic_ms();
+        if (now >= next_check) {
+            check_health(now);
+            next_check = now + HEARTBEAT_INTERVAL_MS;
+        }
+        update_gauges();
+        flush_status();
+        pthread_mutex_unlock(&_clients_mutex);
+    }
+
+    // Whatever the last batch raised
+    pthread_mutex_lock(&_clients_mutex);
+    flush_status();
+    pthread_mutex_unlock(&_clients_mutex);
+
+    close(sock_fd);
+    close(wake_fd);
+    close(epoll_fd);
+    return 0;
+}
+
+void PeerServer::wake_reactor() {
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("eventfd write failed");
+    }
+}
+
+// Called with _clients_mutex held
+void PeerServer::post_status(const std::string& message) {
+    _pending_status.push_back(message);
+    pthread_cond_signal(&_done_cond);
+}
+
+// Called with _clients_mutex held
+void PeerServer::update_interest(size_t index) {
+    Client& c = _clients[index];
+    bool want_write = c.has_pending();
+    if (want_write == c.want_write) {
+        return;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | (want_write ? static_cast<uint32_t>(EPOLLOUT) : 0u);
+    ev.data.u64 = index;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c.client_fd, &ev);
+    c.want_write = want_write;
+}
+
+// Called with _clients_mutex held
+void PeerServer::handle_accept() {
     while (1) {
         Client c;
-        if ((c.client_fd = accept(sock_fd, (struct sockaddr*)&c.address, &c.length)) < 0) {
-            perror("accept failed");
-            continue;
+        c.client_fd = accept4(sock_fd, (struct sockaddr*)&c.address, &c.length,
+                              SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (c.client_fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept failed");
+            }
+            return;
         }
-        
-        printf("Connection accepted from %s:%d\n", 
-               inet_ntoa(c.address.sin_addr), ntohs(c.address.sin_port));
 
-        // Thread-safe update of server's client list
-        pthread_mutex_lock(&_clients_mutex);
+        int opt = 1;
+        setsockopt(c.client_fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
         num_clients++;
         c.id = num_clients;  // Assign a client ID
+        c.last_heard = monotonic_ms();
+        c.last_ping = c.last_heard;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.u64 = _clients.size();
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c.client_fd, &ev);
+        metrics.workers_connected.add(1);
+
+        post_status(std::string("Connection accepted from ") + inet_ntoa(c.address.sin_addr) +
+                    ":" + std::to_string(ntohs(c.address.sin_port)));
         _clients.push_back(c);
-        
-        // Signal the condition variable - the TUI is listening to this
-        pthread_cond_signal(&_clients_cond);
-        pthread_mutex_unlock(&_clients_mutex);
+
+        // Late joiners steal their share of a job that is already running
+        if (job_active) {
+            join_job(_clients.size() - 1);
+            update_interest(_clients.size() - 1);
+        }
     }
 }
 
-static std::vector<std::pair<int, int>> splitNumber(int total, int n) {
-    std::vector<std::pair<int, int>> pairs;
-    
-    if (n <= 0 || total < 0) {
-        return pairs; // return empty vector for invalid input
+// Called with _clients_mutex held
+void PeerServer::handle_writable(size_t index) {
+    Client& c = _clients[index];
+    bool streaming = !c.out_queue.empty() && c.out_queue.front().file_fd >= 0;
+    ssize_t sent = c.flush();
+    if (sent < 0) {
+        close_client(index, std::string("send failed: ") + strerror(errno));
+        return;
     }
+    c.bytes_out += sent;
+    metrics.bytes_sent.add(sent);
+    // A worker busy swallowing a large payload is still alive, small frames
+    // fit in the socket buffer and prove nothing
+    if (streaming && sent > 0) {
+        c.last_heard = monotonic_ms();
+    }
+    update_interest(index);
+}
 
+// Called with _clients_mutex held
+void PeerServer::close_client(size_t index, const std::string& reason) {
+    Client& c = _clients[index];
 
-    int chunkSize = total / n;
-    int remainder = total % n;
-    int start = 0;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c.client_fd, nullptr);
+    close(c.client_fd);
+    c.client_fd = -1;
+    c.closed = true;
+    c.clear_pending();
+    c.reader = FrameReader();
+    metrics.workers_connected.add(-1);
+
+    post_status("Client " + std::to_string(index) + " " + reason);
+    if (c.in_job) {
+        c.in_job = false;
+
+        // Whatever this worker still had to relay now comes from us
+        size_t orphaned = 0;
+        for (size_t sub : c.relay_subtree) {
+            if (_clients[sub].relay_pending && !_clients[sub].closed) {
+                payload_direct(sub);
+                orphaned++;
+            }
+        }
+        if (orphaned > 0) {
+            post_status("Relay through client " + std::to_string(index) + " lost, sending payload directly to " +
+                        std::to_string(orphaned) + " clients");
+        }
+        if (c.offer_pending && !relay_planned && --offers_outstanding == 0) {
+            build_relay_tree();
+        }
 
-    for (int i = 0; i < n; ++i) {
-        int end = start + chunkSize - 1;
-        
-        // Distribute remainder across first few chunks
-        if (i < remainder) {
-            end += 1;
+        tasks.remove_worker(index);
+        if (tree_reduce && c.aggregating) {
+            lose_partials(index);
         }
 
-        pairs.emplace_back(start, end);
-        start = end + 1;
+        // The worker went away before reporting DONE, someone else redoes the ranges
+        while (c.busy()) {
+            auto task = c.tasks.begin();
+            post_status("Client " + std::to_string(index) + " dropped task " + std::to_string(task->first) +
+                        " after " + std::to_string(task->second) + " bytes");
+            finish_task(index, task->first, false);
+        }
     }
+}
+
+// Called with _clients_mutex held
+void PeerServer::join_job(size_t index) {
+    Client& c = _clients[index];
 
-    return pairs;
+    c.in_job = true;
+    c.tasks.clear();
+    c.payload_ready = false;
+    c.offer_pending = true;
+    c.relay_wait = false;
+    c.relay_pending = false;
+    c.relay_subtree.clear();
+    if (!relay_planned) {
+        offers_outstanding++;
+    }
+
+    // Workers keep a cache keyed by payload hash, only send the bytes on a miss
+    PayloadOffer offer = {payload_digest, file_size};
+    std::string payload = encode_payload_offer(offer);
+    c.queue_frame(MsgType::PAYLOAD_OFFER, payload.data(), payload.size());
 }
 
-int PeerServer::send_files() {
-    pthread_cancel(socket_thread);
+// Called with _clients_mutex held
+void PeerServer::send_payload(size_t index) {
+    Client& c = _clients[index];
 
-    std::string status_message;
+    // Header from memory, payload straight from the shared file
+    char header[FRAME_HEADER_SIZE];
+    encode_header(header, MsgType::SCRIPT, static_cast<uint32_t>(file_size));
+    c.queue_buf(header, sizeof(header));
+    c.queue_file(script_fd, 0, file_size);
+    post_status("Queued file for client " + std::to_string(index));
+}
 
-    std::vector<std::pair<int, int>> pairs = splitNumber(get_item_count(), num_clients);
+// Called with _clients_mutex held
+void PeerServer::payload_direct(size_t index) {
+    Client& c = _clients[index];
 
-    std::string bounds;
-    
-    pthread_mutex_lock(&_clients_mutex);
+    send_payload(index);
+    c.payload_ready = true;
+    c.relay_pending = false;
+    dispatch(index);
+    update_interest(index);
+}
 
-    for (int i = 0; i < num_clients; i++) {
-        size_t data = _clients[i].send_buf(_script_buf, file_size);
-        std::pair<int, int>& set = pairs[i];
-      
-        if (data != file_size) {
-                return -1;
+// Called with _clients_mutex held once every worker has answered its offer
+void PeerServer::build_relay_tree() {
+    relay_planned = true;
+
+    // Heap positions 1 .. n, the coordinator itself is position 0
+    std::vector<size_t> nodes;
+    for (size_t i = 0; i < _clients.size(); i++) {
+        if (_clients[i].relay_wait && !_clients[i].closed) {
+            _clients[i].relay_wait = false;
+            nodes.push_back(i);
+        }
+    }
+    if (nodes.empty()) {
+        return;
+    }
+
+    size_t n = nodes.size();
+    size_t k = relay_fanout;
+    for (size_t pos = 1; pos <= n; pos++) {
+        Client& node = _clients[nodes[pos - 1]];
+        node.relay_subtree.clear();
+        for (size_t sub : relay_subtree(pos, n, k)) {
+            node.relay_subtree.push_back(nodes[sub - 1]);
+        }
+        node.relay_pending = pos > k;
+    }
+
+    // The top k get the bytes from us along with the rest of their subtree
+    for (size_t pos = 1; pos <= k && pos <= n; pos++) {
+        size_t index = nodes[pos - 1];
+        Client& root = _clients[index];
+
+        RelayPlan plan;
+        plan.fanout = k;
+        for (size_t sub : root.relay_subtree) {
+            plan.descendants.push_back({_clients[sub].address.sin_addr.s_addr, _clients[sub].relay_port});
+        }
+        if (!plan.descendants.empty()) {
+            std::string payload = encode_relay_plan(plan);
+            root.queue_frame(MsgType::RELAY, payload.data(), payload.size());
+        }
+        payload_direct(index);
+    }
+
+    post_status("Relaying payload to " + std::to_string(n) + " clients through a " +
+                std::to_string(k) + "-ary tree");
+}
+
+// Called with _clients_mutex held, before the job's first TASK_RANGE is queued
+void PeerServer::build_aggregation_tree(const std::vector<int>& live) {
+    // Heap positions 1 .. n under the coordinator at position 0. Workers
+    // with a relay listener come first, only they can take partials from
+    // children.
+    std::vector<size_t> nodes;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int index : live) {
+            Client& c = _clients[index];
+            if (tree_reduce && c.can_reduce && (c.relay_port != 0) == (pass == 0)) {
+                nodes.push_back(index);
+            }
+        }
+    }
+
+    for (int index : live) {
+        _clients[index].aggregating = false;
+        _clients[index].agg_parent = -1;
+    }
+
+    size_t k = reduce_fanin;
+    size_t direct = 0;
+    for (size_t pos = 1; pos <= nodes.size(); pos++) {
+        Client& node = _clients[nodes[pos - 1]];
+        size_t parent = (pos - 1) / k;
+        node.aggregating = true;
+        if (parent > 0 && _clients[nodes[parent - 1]].relay_port != 0) {
+            node.agg_parent = static_cast<int>(nodes[parent - 1]);
+        } else {
+            direct++;
+        }
+    }
+
+    // Workers that folded for an earlier job are told to stream again
+    for (int index : live) {
+        if (_clients[index].can_reduce) {
+            send_aggregate(index);
+        }
+    }
+
+    if (!nodes.empty()) {
+        post_status("Reducing through " + std::to_string(nodes.size()) + " workers in a " + std::to_string(k) +
+                    "-ary tree, " + std::to_string(direct) + " send partials here");
+    }
+}
+
+// Called with _clients_mutex held
+void PeerServer::send_aggregate(size_t index) {
+    Client& c = _clients[index];
+
+    AggregatePlan plan = {static_cast<uint8_t>(ReduceOp::CONCAT), 0, {0, 0}};
+    if (c.aggregating) {
+        plan.op = static_cast<uint8_t>(reducer.get_op());
+        plan.k = static_cast<uint32_t>(reducer.get_k());
+        if (c.agg_parent >= 0) {
+            const Client& parent = _clients[c.agg_parent];
+            plan.parent = {parent.address.sin_addr.s_addr, parent.relay_port};
+        }
+    }
+    std::string payload = encode_aggregate_plan(plan);
+    c.queue_frame(MsgType::AGGREGATE, payload.data(), payload.size());
+}
+
+// Called with _clients_mutex held. False while a task of the batch is still
+// in flight, the partial overtook its DONE and waits for it.
+bool PeerServer::accept_partial(const std::vector<uint32_t>& task_ids, const Partial& partial) {
+    bool known = true;
+    for (uint32_t task_id : task_ids) {
+        Task task;
+        if (awaiting.count(task_id) > 0) {
+            continue;
+        }
+        if (tasks.range_of(task_id, task)) {
+            return false;
+        }
+        known = false;
+    }
+
+    if (known) {
+        std::vector<ItemRange> ranges;
+        for (uint32_t task_id : task_ids) {
+            auto it = awaiting.find(task_id);
+            ranges.push_back({it->second.start, it->second.end});
+            awaiting.erase(it);
+        }
+        reducer.absorb(partial);
+        journal.append(JournalRecord::FOLD, Journal::fold(ranges, partial));
+        return true;
+    }
+
+    // Part of the batch was already given up and runs again, the rest has
+    // to follow it since a partial cannot be taken apart
+    size_t redone = 0;
+    for (uint32_t task_id : task_ids) {
+        auto it = awaiting.find(task_id);
+        if (it != awaiting.end()) {
+            tasks.redo(it->second.start, it->second.end);
+            awaiting.erase(it);
+            redone++;
+        }
+    }
+    post_status("Dropped a partial of " + std::to_string(task_ids.size()) + " tasks that were already rerun, " +
+                std::to_string(redone) + " more ranges run again");
+    if (redone > 0) {
+        dispatch_idle();
+    }
+    return true;
+}
+
+// Called with _clients_mutex held
+void PeerServer::retry_deferred() {
+    for (size_t i = 0; i < deferred.size();) {
+        if (accept_partial(deferred[i].first, deferred[i].second)) {
+            deferred.erase(deferred.begin() + i);
+        } else {
+            i++;
+        }
+    }
+}
+
+// Called with _clients_mutex held when an aggregating worker goes away
+void PeerServer::lose_partials(size_t index) {
+    Client& lost = _clients[index];
+
+    // Partials it held, or that were still on their way to it, are gone
+    size_t redone = 0;
+    for (auto it = awaiting.begin(); it != awaiting.end();) {
+        int hop = static_cast<int>(it->second.worker);
+        while (hop >= 0 && hop != static_cast<int>(index)) {
+            hop = _clients[hop].agg_parent;
+        }
+        if (hop < 0) {
+            ++it;
+            continue;
+        }
+        tasks.redo(it->second.start, it->second.end);
+        it = awaiting.erase(it);
+        redone++;
+    }
+
+    // Its children report to its parent from now on
+    size_t moved = 0;
+    for (size_t i = 0; i < _clients.size(); i++) {
+        Client& child = _clients[i];
+        if (child.agg_parent != static_cast<int>(index)) {
+            continue;
+        }
+        child.agg_parent = lost.agg_parent;
+        if (!child.closed && child.aggregating) {
+            send_aggregate(i);
+            update_interest(i);
+            moved++;
+        }
+    }
+    lost.aggregating = false;
+
+    if (redone > 0 || moved > 0) {
+        post_status("Aggregator " + std::to_string(index) + " lost, " + std::to_string(redone) +
+                    " ranges run again, " + std::to_string(moved) + " children moved up");
+    }
+    if (redone > 0) {
+        dispatch_idle();
+    }
+}
+
+// Called with _clients_mutex held
+void PeerServer::dispatch(size_t index) {
+    Client& c = _clients[index];
+    Task task;
+
+    if (!job_active || !c.in_job || !c.payload_ready) {
+        return;
+    }
+
+    // One task per free slot
+    while (c.has_slot()) {
+        // Nothing left to hand out, back up a straggler instead of idling
+        uint32_t original;
+        bool backup = false;
+        if (!tasks.next(index, task)) {
+            // A backup racing a folded copy could not be told apart in a partial
+            if (tree_reduce || !tasks.speculate(index, task)) {
+                return;
+            }
+            backup = tasks.twin_of(task.id, original);
+        }
+
+        c.tasks[task.id] = 0;
+        if (reducer.active() && !c.aggregating) {
+            reducer.begin(task.id);
+        }
+        metrics.tasks_dispatched.add();
+        if (backup) {
+            metrics.task_backups.add();
+        }
+        c.range_start = task.start;
+        c.range_end = task.end;
+        merger.begin(task.id, task.start, task.end);
+
+        TaskRange range = {task.id, task.start, task.end};
+        std::string payload = encode_task_range(range);
+        c.queue_frame(MsgType::TASK_RANGE, payload.data(), payload.size());
+        post_status("Client " + std::to_string(index) + (backup ? " backing up task " + std::to_string(original) + ", bounds " :
+                                                                   std::string(" computing bounds ")) +
+                    std::to_string(task.start) + " " + std::to_string(task.end) +
+                    " (" + std::to_string(task.end - task.start) + " items)");
+    }
+}
+
+// Called with _clients_mutex held
+void PeerServer::cancel_task(uint32_t task_id) {
+    for (size_t i = 0; i < _clients.size(); i++) {
+        Client& c = _clients[i];
+        if (c.closed || c.tasks.count(task_id) == 0) {
+            continue;
+        }
+
+        // Anything it still sends for the task is ignored, it may already be done
+        std::string payload;
+        put_u32(payload, task_id);
+        c.queue_frame(MsgType::CANCEL, payload.data(), payload.size());
+        c.tasks.erase(task_id);
+        merger.abort(task_id);
+        reducer.abort(task_id);
+        post_status("Client " + std::to_string(i) + " lost the race for its range, task " +
+                    std::to_string(task_id) + " cancelled");
+
+        dispatch(i);
+        update_interest(i);
+        return;
+    }
+}
+
+// Called with _clients_mutex held. Ranges the merger found gone from the
+// result cache are dropped from it and run again, returns their items.
+uint64_t PeerServer::requeue_lost_cache() {
+    uint64_t items = 0;
+    for (const CachedRange& range : merger.take_lost()) {
+        cache.forget(range.start, range.end);
+        tasks.redo(range.start, range.end);
+        items += range.end - range.start;
+        post_status("Cached output of items " + std::to_string(range.start) + "-" + std::to_string(range.end) +
+                    " is gone, running them again");
+    }
+    return items;
+}
+
+// Called with _clients_mutex held
+void PeerServer::finish_task(size_t index, uint32_t task_id, bool completed) {
+    Client& c = _clients[index];
+    c.tasks.erase(task_id);
+
+    uint32_t twin;
+    bool backed_up = tasks.twin_of(task_id, twin);
+
+    if (completed) {
+        Task range;
+        bool known = tasks.range_of(task_id, range);
+        bool folded = tree_reduce && c.aggregating && known;
+        double seconds = tasks.complete(task_id);
+        if (seconds >= 0) {
+            metrics.task_seconds.observe(seconds);
+        }
+        metrics.tasks_completed.add();
+        merger.commit(task_id);
+        requeue_lost_cache();
+        if (folded) {
+            // The output is on its way up the tree, the job waits for it
+            awaiting[task_id] = {range.start, range.end, index};
+        } else if (reducer.active()) {
+            Partial partial = reducer.commit(task_id);
+            if (known) {
+                journal.append(JournalRecord::FOLD, Journal::fold({{range.start, range.end}}, partial));
+            }
+        } else if (merger.written_items() > journaled_items && results.error() == 0) {
+            // More of the output file is final
+            journaled_items = merger.written_items();
+            journal.append(JournalRecord::PREFIX, Journal::prefix(journaled_items, merger.written_bytes()));
+        }
+        if (backed_up) {
+            cancel_task(twin);
+        }
+    } else {
+        metrics.tasks_failed.add();
+        merger.abort(task_id);
+        reducer.abort(task_id);
+        if (backed_up) {
+            // The other copy still covers the range
+            tasks.withdraw(task_id);
+            post_status("Task " + std::to_string(task_id) + " lost, task " + std::to_string(twin) +
+                        " still runs its range");
+        } else if (tasks.requeue(task_id)) {
+            metrics.task_retries.add();
+            post_status("Task " + std::to_string(task_id) + " requeued");
+            dispatch_idle();
+        } else {
+            post_status("Task " + std::to_string(task_id) + " failed too often, giving up on its range");
         }
-        status_message = "Sent file for client " + std::to_string(i) + "\n";
-        interface.add_status_message(status_message);
-        bounds = std::to_string(set.first) + " " + std::to_string(set.second);
-        interface.add_status_message("Computing bounds " + bounds);
-        _clients[i].send_buf(bounds.c_str(), bounds.size());
     }
+
+    check_finished();
+}
+
+// Called with _clients_mutex held. A job whose output stopped reaching the
+// result file is given up, the journal keeps what is really on disk for
+// the next run. Returns false then. ending: the job has just finished and
+// is already marked inactive.
+bool PeerServer::check_results(bool ending) {
+    int err = results.error();
+    if (err == 0) {
+        return true;
+    }
+    if (job_active || ending) {
+        job_active = false;
+        results_failed = true;
+        if (!ending) {
+            job_elapsed_ms = monotonic_ms() - job_started_ms;
+        }
+        post_status("Writing " + std::string(RESULT_FILE) + " failed: " + strerror(err) + ", giving up on the job");
+        journal.close();
+    }
+    return false;
+}
+
+// Called with _clients_mutex held
+void PeerServer::check_finished() {
+    retry_deferred();
+    if (!check_results()) {
+        return;
+    }
+
+    // Every range committed and, with tree reduction, folded in here
+    if (job_active && tasks.finished() && awaiting.empty()) {
+        job_active = false;
+        job_elapsed_ms = monotonic_ms() - job_started_ms;
+        merger.finish(get_item_count() > 0 ? get_item_count() : 0);
+        if (reducer.active()) {
+            // The answer is ready the moment the last range commits
+            std::string answer = reducer.render();
+            results.write(answer.data(), answer.size());
+            post_status(std::string("Reduced ") + std::to_string(reducer.records()) + " records with " +
+                        reduce_name(reducer.get_op()));
+            if (reducer.malformed_bytes() > 0) {
+                post_status(std::to_string(reducer.malformed_bytes()) + " trailing bytes were not whole records");
+            }
+        }
+        post_status("Job complete, " + std::to_string(tasks.steal_count()) + " ranges stolen, " +
+                    std::to_string(tasks.requeue_count()) + " requeued, " +
+                    std::to_string(tasks.backup_count()) + " backed up, " +
+                    std::to_string(merger.spilled_runs()) + " spilled to disk");
+        if (merger.missing_items() > 0) {
+            post_status(std::to_string(merger.missing_items()) + " items have no output");
+        }
+
+        // Nothing left to resume, once all of it is in the file
+        results.flush();
+        if (!check_results(true)) {
+            return;
+        }
+        journal.append(JournalRecord::END, std::string());
+        journal.close();
+    }
+}
+
+// Called with _clients_mutex held
+void PeerServer::dispatch_idle() {
+    for (size_t i = 0; i < _clients.size(); i++) {
+        if (!_clients[i].closed && _clients[i].in_job && _clients[i].has_slot()) {
+            dispatch(i);
+            update_interest(i);
+        }
+    }
+}
+
+// Called with _clients_mutex held, once per heartbeat interval
+void PeerServer::check_health(uint64_t now) {
+    check_results();
+
+    // A task past its deadline means its worker is hung, even if it still talks
+    for (uint32_t task_id : tasks.overdue()) {
+        for (size_t i = 0; i < _clients.size(); i++) {
+            if (!_clients[i].closed && _clients[i].tasks.count(task_id) > 0) {
+                close_client(i, "missed the deadline for task " + std::to_string(task_id));
+                break;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < _clients.size(); i++) {
+        Client& c = _clients[i];
+        if (c.closed) {
+            continue;
+        }
+        if (now - c.last_heard > HEARTBEAT_TIMEOUT_MS) {
+            close_client(i, "stopped answering heartbeats");
+            continue;
+        }
+        if (now - c.last_ping >= HEARTBEAT_INTERVAL_MS) {
+            // The worker echoes the send time back
+            std::string payload;
+            put_u64(payload, now);
+            c.queue_frame(MsgType::HEARTBEAT, payload.data(), payload.size());
+            c.last_ping = now;
+            update_interest(i);
+        }
+    }
+
+    // Stragglers show up over time, idle workers get another chance to back them up
+    if (job_active) {
+        dispatch_idle();
+    }
+}
+
+// Called with _clients_mutex held, after every batch of reactor events
+void PeerServer::update_gauges() {
+    metrics.queue_items.set(static_cast<int64_t>(tasks.unassigned()));
+    metrics.tasks_in_flight.set(static_cast<int64_t>(tasks.in_flight_count()));
+    metrics.items_done.set(static_cast<int64_t>(tasks.items_done()));
+}
+
+void PeerServer::set_relay_fanout(int fanout) {
+    pthread_mutex_lock(&_clients_mutex);
+    relay_fanout = fanout > 0 ? (fanout > 255 ? 255 : fanout) : 0;
     pthread_mutex_unlock(&_clients_mutex);
-    return 0;
 }
 
-void write_buffer_to_file(const char* filename, const char* buffer, size_t buffer_size) {
-    FILE* file = fopen(filename, "ab"); // Open in append binary mode
-    if (file == NULL) {
-        perror("Error opening file");
-        exit(EXIT_FAILURE);
+void PeerServer::set_task_timeout(double seconds) {
+    pthread_mutex_lock(&_clients_mutex);
+    tasks.set_task_timeout(seconds);
+    pthread_mutex_unlock(&_clients_mutex);
+}
+
+void PeerServer::set_task_memory(uint64_t bytes) {
+    pthread_mutex_lock(&_clients_mutex);
+    task_memory = bytes;
+    pthread_mutex_unlock(&_clients_mutex);
+}
+
+void PeerServer::set_backup_factor(double factor) {
+    pthread_mutex_lock(&_clients_mutex);
+    tasks.set_backup_factor(factor);
+    pthread_mutex_unlock(&_clients_mutex);
+}
+
+void PeerServer::set_metrics_port(uint16_t port) {
+    metrics_port = port;
+}
+
+void PeerServer::set_reduce(ReduceOp op, size_t k) {
+    pthread_mutex_lock(&_clients_mutex);
+    reducer.configure(op, k);
+    pthread_mutex_unlock(&_clients_mutex);
+}
+
+void PeerServer::set_reduce_fanin(int fanin) {
+    pthread_mutex_lock(&_clients_mutex);
+    reduce_fanin = fanin > 0 ? fanin : 0;
+    pthread_mutex_unlock(&_clients_mutex);
+}
+
+void PeerServer::set_resume(bool resume) {
+    pthread_mutex_lock(&_clients_mutex);
+    this->resume = resume;
+    pthread_mutex_unlock(&_clients_mutex);
+}
+
+void PeerServer::set_result_cache(uint64_t bytes) {
+    pthread_mutex_lock(&_clients_mutex);
+    cache.set_max_bytes(bytes);
+    pthread_mutex_unlock(&_clients_mutex);
+}
+
+void PeerServer::set_cache_params(const std::string& params) {
+    pthread_mutex_lock(&_clients_mutex);
+    cache_params = params;
+    pthread_mutex_unlock(&_clients_mutex);
+}
+
+void PeerServer::set_target_task_seconds(double seconds) {
+    pthread_mutex_lock(&_clients_mutex);
+    tasks.set_target_seconds(seconds);
+    pthread_mutex_unlock(&_clients_mutex);
+}
+
+// One line per worker: last chunk size and measured rate
+std::string PeerServer::scheduler_summary() {
+    std::string summary;
+    char entry[64];
+
+    pthread_mutex_lock(&_clients_mutex);
+    for (const auto& rate : tasks.worker_rates()) {
+        snprintf(entry, sizeof(entry), "%sc%d %ux%llu@%.1f/s", summary.empty() ? "" : "  ", rate.first,
+                 rate.second.slots, static_cast<unsigned long long>(rate.second.last_chunk), rate.second.items_per_sec);
+        summary += entry;
     }
-    
-    size_t written = fwrite(buffer, 1, buffer_size, file);
-    if (written != buffer_size) {
-        perror("Error writing to file");
-        fclose(file);
-        exit(EXIT_FAILURE);
+    pthread_mutex_unlock(&_clients_mutex);
+
+    return summary;
+}
+
+void PeerServer::telemetry(std::vector<WorkerTelemetry>& workers, JobTelemetry& job) {
+    pthread_mutex_lock(&_clients_mutex);
+    uint64_t now = monotonic_ms();
+    const std::map<int, WorkerRate>& rates = tasks.worker_rates();
+
+    workers.resize(_clients.size());
+    for (size_t i = 0; i < _clients.size(); i++) {
+        const Client& c = _clients[i];
+        WorkerTelemetry& row = workers[i];
+
+        row.index = static_cast<int>(i);
+        snprintf(row.address, sizeof(row.address), "%s:%d", inet_ntoa(c.address.sin_addr), ntohs(c.address.sin_port));
+        row.state = c.closed ? "gone" : !c.greeted ? "hello" : !c.in_job ? "idle" :
+                    !c.payload_ready ? "loading" : c.busy() ? "running" : "idle";
+        row.slots = c.slots;
+        row.running = c.tasks.size();
+        row.range_start = c.range_start;
+        row.range_end = c.range_end;
+        row.bytes_in = c.bytes_in;
+        row.bytes_out = c.bytes_out;
+        row.rtt_ms = c.rtt_ms;
+        row.since_heard_ms = c.closed ? 0 : now - c.last_heard;
+        row.gone = c.closed;
+
+        auto rate = rates.find(static_cast<int>(i));
+        row.items_done = rate != rates.end() ? rate->second.items_done : 0;
+        row.items_per_sec = rate != rates.end() ? rate->second.items_per_sec * rate->second.slots : 0;
     }
-    
-    fclose(file);
+
+    job.active = job_active;
+    job.total = job_started_ms > 0 && get_item_count() > 0 ? get_item_count() : 0;
+    job.done = job.total - std::min<uint64_t>(job.total, tasks.remaining());
+    job.items_done = tasks.items_done();
+    job.elapsed_seconds = (job_active ? now - job_started_ms : job_elapsed_ms) / 1000.0;
+    pthread_mutex_unlock(&_clients_mutex);
 }
 
-int PeerServer::recv_output() {
-    constexpr size_t outbuf_size = 4096*10;
-    char* output_buf = new char[outbuf_size];
-    
-    interface.add_status_message("Receiving output from clients...");
-
-    for (int i = 0; i < num_clients; i++) {
-      //std::this_thread::sleep_for(std::chrono::milliseconds(400));
-        interface.add_status_message("Reading output from client " + std::to_string(i));
-        
-        size_t total_received = 0;
-        bool more_data = true;
-        
-        // Continue receiving until no more data or connection closed
-        while (more_data) {
-            pthread_mutex_lock(&_clients_mutex);
-            
-            // Check if client connection is still valid
-            if (i >= _clients.size() || _clients[i].client_fd < 0) {
-                interface.add_status_message("Client " + std::to_string(i) + " connection closed");
-                pthread_mutex_unlock(&_clients_mutex);
+int PeerServer::send_files() {
+    pthread_mutex_lock(&_clients_mutex);
+    if (job_cancelled) {
+        pthread_mutex_unlock(&_clients_mutex);
+        return -1;
+    }
+
+    // Only workers that are still connected take part in the job
+    std::vector<int> live;
+    for (size_t i = 0; i < _clients.size(); i++) {
+        if (!_clients[i].closed) {
+            live.push_back(i);
+        }
+    }
+
+    if (live.empty()) {
+        pthread_mutex_unlock(&_clients_mutex);
+        events.add_status_message("No clients connected");
+        return 0;
+    }
+
+    // A journal of this very job that never reached its end tells what an
+    // earlier run already finished, the output file still holds its part
+    uint64_t total = get_item_count() > 0 ? get_item_count() : 0;
+    JobKey key = {payload_digest, total, static_cast<uint8_t>(reducer.get_op()),
+                  reducer.active() ? static_cast<uint32_t>(reducer.get_k()) : 0};
+    struct stat st;
+    uint64_t result_size = stat(RESULT_FILE, &st) == 0 ? st.st_size : 0;
+    JournalState done;
+    journal.close();
+    reducer.reset();
+    bool resumed = resume && Journal::recover(JOURNAL_FILE, key, result_size, reducer, done);
+    if (!resumed) {
+        reducer.reset();
+        done = JournalState();
+    }
+
+    // Stays open across jobs, each job rewrites it in item order
+    if (!results.open(RESULT_FILE) || !results.truncate(done.prefix_bytes)) {
+        pthread_mutex_unlock(&_clients_mutex);
+        events.add_status_message("Could not open " + std::string(RESULT_FILE));
+        return -1;
+    }
+
+    // Range sizes adapt per worker to hit the target task duration
+    tasks.reset(total, live);
+    merger.reset(done.prefix_items, done.prefix_bytes);
+    tasks.skip(0, done.prefix_items);
+    for (const ItemRange& range : done.folded) {
+        tasks.skip(range.first, range.second);
+        merger.skip(range.first, range.second);
+    }
+    journaled_items = done.prefix_items;
+    failed_exits = 0;
+    results_failed = false;
+
+    // Text output of ranges an earlier job ran is read back from the result
+    // cache, fresh output goes into it
+    uint64_t cached_items = 0;
+    merger.set_cache(nullptr);
+    if (cache.enabled() && !reducer.active()) {
+        std::string cache_key = digest_hex(payload_digest);
+        if (!cache_params.empty()) {
+            cache_key += "-" + digest_hex(digest_payload(cache_params.data(), cache_params.size())).substr(0, 12);
+        }
+        cache.trim();
+        if (cache.select(cache_key)) {
+            std::vector<CachedRange> ranges = cache.cover(done.prefix_items, total);
+            for (const CachedRange& range : ranges) {
+                tasks.skip(range.start, range.end);
+                merger.cached(range.start, range.end, range.path, range.bytes);
+                cached_items += range.end - range.start;
+            }
+            cached_items -= requeue_lost_cache();
+            merger.set_cache(&cache);
+            if (cached_items > 0) {
+                events.add_status_message(std::to_string(cached_items) + " items in " + std::to_string(ranges.size()) +
+                                          " ranges served from the result cache");
+            }
+        }
+    }
+    awaiting.clear();
+    deferred.clear();
+    tree_reduce = reducer.active() && reduce_fanin > 0;
+    job_active = !tasks.finished() || resumed || cached_items > 0;
+
+    // The new journal starts with what the old one had, compacted
+    std::string initial = Journal::record(JournalRecord::JOB, Journal::job(key));
+    if (done.prefix_items > 0) {
+        initial += Journal::record(JournalRecord::PREFIX, Journal::prefix(done.prefix_items, done.prefix_bytes));
+    }
+    if (!done.folded.empty()) {
+        initial += Journal::record(JournalRecord::FOLD, Journal::fold(done.folded, reducer.current()));
+    }
+    if (!journal.open(JOURNAL_FILE, RESULT_FILE, initial)) {
+        events.add_status_message("Could not open " + std::string(JOURNAL_FILE) + ", progress will not survive a restart");
+    }
+    if (resumed) {
+        events.add_status_message("Resuming from " + std::string(JOURNAL_FILE) + ", " +
+                                  std::to_string(total - tasks.remaining()) + " of " + std::to_string(total) +
+                                  " items already done");
+    }
+    job_started_ms = monotonic_ms();
+    job_elapsed_ms = 0;
+    offers_outstanding = 0;
+    relay_planned = relay_fanout <= 0;
+
+    char target[32];
+    snprintf(target, sizeof(target), "%.1f", tasks.get_target_seconds());
+    events.add_status_message("Splitting " + std::to_string(total) + " items across " +
+                                 std::to_string(live.size()) + " clients, " + target + "s per task");
+
+    // The plan has to reach each worker before its first range
+    build_aggregation_tree(live);
+    for (int index : live) {
+        join_job(index);
+    }
+
+    // An earlier run may have been cut short after its last range
+    check_finished();
+    pthread_mutex_unlock(&_clients_mutex);
+
+    // The reactor thread does the actual sends
+    wake_reactor();
+    return 0;
+}
+
+// Called with _clients_mutex held
+void PeerServer::handle_frame(size_t index, Frame& frame) {
+    Client& c = _clients[index];
+
+    switch (frame.type) {
+        case MsgType::RESULT_CHUNK: {
+            // Payload is the task id followed by raw output bytes
+            if (frame.payload.size() < 4) {
                 break;
             }
-            
-            // Set non-blocking mode to check for more data
-            int flags = fcntl(_clients[i].client_fd, F_GETFL, 0);
-            fcntl(_clients[i].client_fd, F_SETFL, flags | O_NONBLOCK);
-            
-            // Try to receive data
-            ssize_t received = recv(_clients[i].client_fd, output_buf, outbuf_size, 0);
-            
-            // Restore blocking mode
-            fcntl(_clients[i].client_fd, F_SETFL, flags);
-            
-            if (received > 0) {
-                // Got data, write it to file
-                pthread_mutex_unlock(&_clients_mutex);
-                write_buffer_to_file("out.txt", output_buf, received);
-                total_received += received;
-                interface.add_status_message("Received " + std::to_string(received) + " bytes from client " + std::to_string(i));
+            auto task = c.tasks.find(get_u32(frame.payload.data()));
+            if (task == c.tasks.end()) {
+                break;
             }
-            else if (received == 0) {
-                // Connection closed
-                interface.add_status_message("Client " + std::to_string(i) + " connection closed");
-                pthread_mutex_unlock(&_clients_mutex);
-                more_data = false;
+            if (reducer.active()) {
+                reducer.append(task->first, frame.payload.data() + 4, frame.payload.size() - 4);
+            } else {
+                merger.append(task->first, frame.payload.data() + 4, frame.payload.size() - 4);
             }
-            else {
-                // No data available or error
-                if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                    // No more data available right now
-                    pthread_mutex_unlock(&_clients_mutex);
-                    
-                    // If we've received anything, break and consider it complete
-                    if (total_received > 0) {
-                        more_data = false;
-                    } else {
-                        // Wait a bit and try again
-                        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-                    }
-                } 
-                else {
-                    // Actual error
-                    interface.add_status_message("Error receiving from client " + std::to_string(i) + ": " + strerror(errno));
-                    pthread_mutex_unlock(&_clients_mutex);
-                    more_data = false;
+            task->second += frame.payload.size() - 4;
+            break;
+        }
+        case MsgType::DONE: {
+            TaskDone done;
+            if (!decode_done(frame.payload, done) || c.tasks.count(done.task_id) == 0) {
+                break;
+            }
+            size_t received = c.tasks[done.task_id];
+            post_status("Client " + std::to_string(index) + " finished task " + std::to_string(done.task_id) +
+                        " (status " + std::to_string(done.status) + ", " + std::to_string(received) + " bytes)");
+            if (done.status != 0) {
+                merger.keep_uncached(done.task_id);
+            }
+            bool completed = true;
+            if (done.status == TASK_NOT_RUN) {
+                // The worker could not run it, or lost it, the range goes again
+                post_status("Client " + std::to_string(index) + " could not run task " +
+                            std::to_string(done.task_id) + ", dropping its output");
+                completed = false;
+            } else if (done.bytes != received) {
+                // A short stream never reaches the output file
+                post_status("Client " + std::to_string(index) + " task " + std::to_string(done.task_id) +
+                            " announced " + std::to_string(done.bytes) + " bytes, dropping its output");
+                completed = false;
+            }
+            if (completed && done.status != 0) {
+                failed_exits++;
+            }
+            finish_task(index, done.task_id, completed);
+
+            // Pull the next range straight away
+            dispatch(index);
+            update_interest(index);
+            break;
+        }
+        case MsgType::PAYLOAD_STATUS: {
+            PayloadStatus status;
+            if (!decode_payload_status(frame.payload, status) || !c.in_job || c.payload_ready ||
+                status.digest != payload_digest) {
+                break;
+            }
+
+            bool answered_offer = c.offer_pending;
+            c.offer_pending = false;
+
+            if (status.cached) {
+                post_status("Client " + std::to_string(index) + (c.relay_pending ? " received payload " : " has payload ") +
+                            digest_hex(payload_digest).substr(0, 12) + (c.relay_pending ? " from a peer" : " cached"));
+                c.relay_pending = false;
+                c.payload_ready = true;
+                dispatch(index);
+                update_interest(index);
+            } else if (!relay_planned && relay_fanout > 0 && c.relay_port != 0) {
+                // Wait until every worker answered, then fan out through a tree
+                c.relay_wait = true;
+            } else {
+                // TASK_RANGE follows SCRIPT on the same stream, no need to wait
+                payload_direct(index);
+            }
+
+            if (answered_offer && !relay_planned && --offers_outstanding == 0) {
+                build_relay_tree();
+            }
+            break;
+        }
+        case MsgType::HELLO: {
+            Hello hello;
+            if (!decode_hello(frame.payload, hello)) {
+                break;
+            }
+            c.greeted = true;
+            c.relay_port = hello.relay_port;
+            c.memory_bytes = hello.memory_bytes;
+            c.score = hello.score;
+            c.can_reduce = (hello.flags & HELLO_CAN_REDUCE) != 0;
+
+            // Fewer slots than cores when memory would not hold one task per core
+            c.slots = hello.slots;
+            if (task_memory > 0 && hello.memory_bytes > 0) {
+                uint64_t fit = hello.memory_bytes / task_memory;
+                c.slots = static_cast<uint16_t>(std::max<uint64_t>(1, std::min<uint64_t>(c.slots, fit)));
+            }
+            tasks.set_capacity(index, c.slots, c.score);
+            post_status("Client " + std::to_string(index) + " runs " + std::to_string(c.slots) + " tasks at once, " +
+                        std::to_string(hello.memory_bytes >> 20) + " MB" +
+                        (hello.score > 0 ? ", score " + std::to_string(hello.score) : std::string()));
+
+            // A job may already be waiting on the extra slots
+            dispatch(index);
+            update_interest(index);
+            break;
+        }
+        case MsgType::RELAY_FAILED: {
+            // A relay could not reach part of its subtree, serve those directly
+            std::vector<Endpoint> failed;
+            if (!decode_endpoints(frame.payload, 0, failed)) {
+                break;
+            }
+            for (size_t i = 0; i < _clients.size(); i++) {
+                Client& peer = _clients[i];
+                Endpoint endpoint = {peer.address.sin_addr.s_addr, peer.relay_port};
+                if (peer.relay_pending && !peer.closed &&
+                    std::find(failed.begin(), failed.end(), endpoint) != failed.end()) {
+                    payload_direct(i);
                 }
             }
+            post_status("Client " + std::to_string(index) + " could not relay to " +
+                        std::to_string(failed.size()) + " peers");
+            break;
         }
-        
-        interface.add_status_message("Total received from client " + std::to_string(i) + ": " + std::to_string(total_received) + " bytes");
+        case MsgType::PARTIAL: {
+            std::vector<uint32_t> task_ids;
+            Partial partial;
+            if (!tree_reduce || !decode_partial_batch(frame.payload, task_ids, partial)) {
+                break;
+            }
+            if (!accept_partial(task_ids, partial)) {
+                deferred.emplace_back(std::move(task_ids), std::move(partial));
+            }
+            check_finished();
+            break;
+        }
+        case MsgType::HEARTBEAT:
+            if (frame.payload.size() == 8) {
+                uint64_t sent = get_u64(frame.payload.data());
+                c.rtt_ms = monotonic_ms() - sent;
+            }
+            break;
+        default:
+            post_status("Client " + std::to_string(index) + " sent unexpected message type " +
+                        std::to_string(static_cast<int>(frame.type)));
+            break;
     }
-    
-    delete[] output_buf;
-    interface.add_status_message("Finished receiving output from all clients");
+}
+
+// Called with _clients_mutex held
+void PeerServer::handle_readable(size_t index) {
+    Client& c = _clients[index];
+
+    // A worker may send its last DONE and hang up in one go, what arrived
+    // before the end is handled before the client is closed
+    std::string closed_reason;
+    while (1) {
+        ssize_t received = recv(c.client_fd, _recv_buf, RECV_BUF_SIZE, 0);
+
+        if (received > 0) {
+            c.reader.feed(_recv_buf, received);
+            c.bytes_in += received;
+            metrics.bytes_received.add(received);
+            c.last_heard = monotonic_ms();
+        }
+        else if (received == 0) {
+            closed_reason = "connection closed";
+            break;
+        }
+        else if (errno == EINTR) {
+            continue;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        }
+        else {
+            closed_reason = std::string("error receiving: ") + strerror(errno);
+            break;
+        }
+    }
+
+    Frame frame;
+    int status = 0;
+    while (!c.closed && (status = c.reader.next(frame)) > 0) {
+        handle_frame(index, frame);
+    }
+    if (c.closed) {
+        return;
+    }
+    if (status < 0) {
+        close_client(index, "sent a malformed frame");
+        return;
+    }
+    if (!closed_reason.empty()) {
+        close_client(index, closed_reason);
+    }
+}
+
+// Called on the reactor with _clients_mutex held, which is dropped while
+// the messages are passed on. Nothing piles up between jobs.
+void PeerServer::flush_status() {
+    if (_pending_status.empty()) {
+        return;
+    }
+    std::vector<std::string> messages;
+    messages.swap(_pending_status);
+    pthread_mutex_unlock(&_clients_mutex);
+
+    for (const std::string& message : messages) {
+        events.add_status_message(message);
+    }
+
+    pthread_mutex_lock(&_clients_mutex);
+}
+
+// Called with _clients_mutex held, which is dropped while the summary is
+// passed on. Returns false once the job is over.
+bool PeerServer::relay_status() {
+    pthread_mutex_unlock(&_clients_mutex);
+    events.set_scheduler_summary(scheduler_summary());
+    pthread_mutex_lock(&_clients_mutex);
+    return job_active;
+}
+
+// Called with _clients_mutex held
+size_t PeerServer::live_workers() {
+    size_t live = 0;
+    for (const Client& c : _clients) {
+        live += !c.closed && c.greeted ? 1 : 0;
+    }
+    return live;
+}
+
+int PeerServer::recv_output() {
+    events.add_status_message("Receiving output from clients...");
+
+    // The reactor does the actual reads, this thread only relays its
+    // progress until every worker in the job has finished
+    pthread_mutex_lock(&_clients_mutex);
+    while (relay_status()) {
+        pthread_cond_wait(&_done_cond, &_clients_mutex);
+    }
+    pthread_mutex_unlock(&_clients_mutex);
+
+    events.add_status_message("Finished receiving output from all clients");
     return 0;
 }
 
-void PeerServer::run() {
+void PeerServer::cancel_job() {
+    pthread_mutex_lock(&_clients_mutex);
+    job_cancelled = true;
+    if (job_active) {
+        job_active = false;
+        job_elapsed_ms = monotonic_ms() - job_started_ms;
+        post_status("Job cancelled");
+    }
+    pthread_cond_broadcast(&_done_cond);
+    pthread_mutex_unlock(&_clients_mutex);
+    wake_reactor();
+}
+
+void PeerServer::start() {
+    if (metrics_port != 0) {
+        if (exporter.start(metrics_port)) {
+            events.add_status_message("Metrics at http://127.0.0.1:" + std::to_string(metrics_port) + "/metrics");
+        } else {
+            events.add_status_message("Could not serve metrics on port " + std::to_string(metrics_port) + ": " +
+                                      strerror(errno));
+        }
+    }
     pthread_create(&socket_thread, nullptr, &PeerServer::socket_thread_fn, this);
-    
-    // Run the TUI in the main thread
-    interface.run();
+}
 
-    pthread_cancel(socket_thread);
-    
+void PeerServer::stop() {
+    running = false;
+    wake_reactor();
+    pthread_join(socket_thread, nullptr);
+    exporter.stop();
+}
+
+static struct timespec deadline_after(double seconds) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += static_cast<time_t>(seconds);
+    deadline.tv_nsec += static_cast<long>((seconds - static_cast<time_t>(seconds)) * 1e9);
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    return deadline;
+}
+
+int PeerServer::run_headless(size_t min_workers, double wait_seconds) {
+    start();
+    events.add_status_message("Waiting up to " + std::to_string(static_cast<long>(wait_seconds)) + "s for " +
+                              std::to_string(min_workers) + " workers on port " + std::to_string(PORT));
+
+    // Workers count once their HELLO arrived, so the split sees their capacity
+    struct timespec deadline = deadline_after(wait_seconds);
+    pthread_mutex_lock(&_clients_mutex);
+    while (live_workers() < min_workers) {
+        if (pthread_cond_timedwait(&_done_cond, &_clients_mutex, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    size_t workers = live_workers();
+    pthread_mutex_unlock(&_clients_mutex);
+
+    if (workers == 0) {
+        events.add_status_message("No workers connected, giving up");
+        stop();
+        return 1;
+    }
+    if (workers < min_workers) {
+        events.add_status_message("Only " + std::to_string(workers) + " workers after " +
+                                  std::to_string(static_cast<long>(wait_seconds)) + "s, starting anyway");
+    }
+
+    if (send_files() != 0) {
+        stop();
+        return 1;
+    }
+
+    // Like recv_output(), but a job that has lost every worker for a whole
+    // wait period is given up instead of waiting for someone to join
+    int status = 0;
+    uint64_t orphaned_since = 0;
+    pthread_mutex_lock(&_clients_mutex);
+    while (relay_status()) {
+        if (live_workers() > 0) {
+            orphaned_since = 0;
+        } else if (orphaned_since == 0) {
+            orphaned_since = monotonic_ms();
+        } else if (monotonic_ms() - orphaned_since > wait_seconds * 1000) {
+            status = 1;
+            break;
+        }
+
+        struct timespec tick = deadline_after(HEARTBEAT_INTERVAL_MS / 1000.0);
+        pthread_cond_timedwait(&_done_cond, &_clients_mutex, &tick);
+    }
+    uint64_t missing = merger.missing_items();
+    uint64_t abandoned = tasks.abandoned();
+    size_t failed = failed_exits;
+    bool unwritten = results_failed;
+    pthread_mutex_unlock(&_clients_mutex);
+    stop();
+
+    if (status != 0) {
+        events.add_status_message("Every worker is gone, abandoning the job");
+        return status;
+    }
+    if (unwritten) {
+        return 1;
+    }
+    if (missing > 0 || abandoned > 0 || failed > 0) {
+        if (missing > 0) {
+            events.add_status_message(std::to_string(missing) + " items have no output in " + RESULT_FILE);
+        }
+        if (abandoned > 0) {
+            events.add_status_message(std::to_string(abandoned) + " items were given up after failing too often");
+        }
+        if (failed > 0) {
+            events.add_status_message(std::to_string(failed) + " ranges ran in a script that exited nonzero");
+        }
+        return 2;
+    }
+    events.add_status_message("Results written to " + std::string(RESULT_FILE));
+    return 0;
 }
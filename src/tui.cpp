@@ -4,12 +4,16 @@
 #include <arpa/inet.h>  // For inet_ntoa and related functions
 #include <time.h>       // For clock_gettime
 #include <errno.h>      // For ETIMEDOUT
+#include <string.h>     // For memchr
+#include <poll.h>
+#include <algorithm>
+#include <unistd.h>
 #include "tui.h"
 #include "server.h"
 #include "client.h"
 
 
-TUI::TUI() : intro_win_(nullptr), main_win_(nullptr), client_win_(nullptr), 
+TUI::TUI() : intro_win_(nullptr), main_win_(nullptr), workers_win_(nullptr), 
              status_win_(nullptr), intro_panel_(nullptr), main_panel_(nullptr) {
     // Lock the mutex before initializing ncurses
     pthread_mutex_lock(&ncurses_mutex);
@@ -17,11 +21,7 @@ TUI::TUI() : intro_win_(nullptr), main_win_(nullptr), client_win_(nullptr),
     pthread_mutex_unlock(&ncurses_mutex);
     
     socket_address_ = "0.0.0.0:8080";
-    
-    // Thread-safe initialization of client list with just the server
-    pthread_mutex_lock(&clients_mutex);
-    clients_.push_back("Main Server (192.168.1.100:8080)");
-    pthread_mutex_unlock(&clients_mutex);
+    log_file_ = fopen(STATUS_LOG_FILE, "w");
 }
 
 TUI::~TUI() {
@@ -33,55 +33,27 @@ TUI::~TUI() {
     if (main_panel_) del_panel(main_panel_);
     if (intro_win_) delwin(intro_win_);
     if (main_win_) delwin(main_win_);
-    if (client_win_) delwin(client_win_);
+    if (workers_win_) delwin(workers_win_);
     if (status_win_) delwin(status_win_);
     endwin();
     
     // Unlock before destroying mutex
     pthread_mutex_unlock(&ncurses_mutex);
     
+    // The render thread is gone, whatever it left goes to the log
+    drain_status();
+    if (log_file_) {
+        fclose(log_file_);
+    }
+
     // Destroy the mutexes
     pthread_mutex_destroy(&ncurses_mutex);
-    pthread_mutex_destroy(&clients_mutex);
+    pthread_mutex_destroy(&summary_mutex);
+    pthread_mutex_destroy(&overflow_mutex);
 }
 
-void TUI::set_server_ref(PeerServer* server, pthread_mutex_t* clients_mutex, 
-                       pthread_cond_t* clients_cond, std::vector<Client>* clients) {
+void TUI::set_server_ref(PeerServer* server) {
     server_ref = server;
-    server_clients_mutex = clients_mutex;
-    server_clients_cond = clients_cond;
-    server_clients = clients;
-}
-
-void TUI::check_for_new_clients() {
-    // Check that we have valid server references
-    if (!server_clients_mutex || !server_clients) {
-        return;
-    }
-    
-    // Lock the server's clients mutex
-    pthread_mutex_lock(server_clients_mutex);
-    
-    // Process any new clients
-    for (size_t i = last_client_count; i < server_clients->size(); ++i) {
-        const Client& client = (*server_clients)[i];
-        
-        // Format client info
-        char client_info[100];
-        snprintf(client_info, sizeof(client_info), "Client %zu (%s:%d)", 
-                 i, 
-                 inet_ntoa(client.address.sin_addr), 
-                 ntohs(client.address.sin_port));
-        
-        // Add the client to the TUI
-        add_client(client_info);
-    }
-    
-    // Update our count
-    last_client_count = server_clients->size();
-    
-    // Unlock the server's clients mutex
-    pthread_mutex_unlock(server_clients_mutex);
 }
 
 void TUI::init_ncurses() {
@@ -93,6 +65,9 @@ void TUI::init_ncurses() {
     noecho();
     keypad(stdscr, TRUE);
     curs_set(0);
+
+    // Input is polled for outside the ncurses lock, getch only collects it
+    nodelay(stdscr, TRUE);
     
     if (has_colors()) {
         start_color();
@@ -181,23 +156,16 @@ void TUI::create_main_interface() {
     main_panel_ = new_panel(main_win_);
     box(main_win_, 0, 0);
     
-    // Client window (left 30%)
-    int client_width = (width - 2) * 0.3;
-    client_win_ = newwin(height - 4, client_width - 1, 2, 2);
-    box(client_win_, 0, 0);
+    // Placeholders, render_main_interface() lays them out below the banner
+    workers_win_ = newwin(height - 4, width - 2, 2, 2);
+    status_win_ = newwin(height - 4, width - 2, 2, 2);
     
-    // Status window (right 70%)
-    int status_width = (width - 2) * 0.7 - 1;
-    status_win_ = newwin(height - 4, status_width, 2, client_width + 1);
-    box(status_win_, 0, 0);
-    
-    render_main_interface();
+    // Drawn by the render thread
+    dirty_layout_ = true;
 }
 
+// Called on the render thread with ncurses_mutex held
 void TUI::render_main_interface() {
-    // Lock the mutex before accessing ncurses
-    pthread_mutex_lock(&ncurses_mutex);
-    
     // Get window dimensions
     int win_width = getmaxx(main_win_);
     
@@ -235,150 +203,284 @@ void TUI::render_main_interface() {
     }
     wattroff(main_win_, COLOR_PAIR(3) | A_BOLD);
     
-    // Client window (left 30%) - adjusted position to be below the banner
-    int client_start_y = start_y + banner_height + 2;
-    int client_width = (win_width - 4) * 0.3;
-    int client_height = getmaxy(main_win_) - client_start_y - 4;
+    // Worker table on top, status messages below, both full width under the banner
+    int panes_start_y = start_y + banner_height + 2;
+    int panes_height = getmaxy(main_win_) - panes_start_y - 3;
     
-    // Check if there's enough space for client window
-    if (client_height < 5) {
-        // Not enough vertical space, use simpler layout
-        client_height = 5;
-        client_start_y = getmaxy(main_win_) - client_height - 3;
+    // Check if there's enough space for both panes
+    if (panes_height < 14) {
+        // Not enough vertical space, draw over the banner
+        panes_height = std::max(14, getmaxy(main_win_) - 5);
+        panes_start_y = getmaxy(main_win_) - panes_height - 3;
     }
+    int workers_height = panes_height / 2;
+    int status_height = panes_height - workers_height;
     
-    // Recreate client window with new position
-    if (client_win_) delwin(client_win_);
-    client_win_ = derwin(main_win_, client_height, client_width, client_start_y, 2);
-    box(client_win_, 0, 0);
-    
-    // Status window (right 70%) - adjusted position to be below the banner
-    int status_width = (win_width - 4) * 0.7 - 2;
+    // Recreate both windows with their new position
+    if (workers_win_) delwin(workers_win_);
+    workers_win_ = derwin(main_win_, workers_height, win_width - 4, panes_start_y, 2);
     if (status_win_) delwin(status_win_);
-    status_win_ = derwin(main_win_, client_height, status_width, client_start_y, client_width + 4);
-    box(status_win_, 0, 0);
+    status_win_ = derwin(main_win_, status_height, win_width - 4, panes_start_y + workers_height, 2);
     
-    // Client list
-    wattron(client_win_, COLOR_PAIR(3));
-    mvwprintw(client_win_, 1, 1, "Connected Clients:");
-    wattroff(client_win_, COLOR_PAIR(3));
+    // Help text
+    mvwprintw(main_win_, getmaxy(main_win_) - 2, 2, "Press 'r' to start, 's' to view script, 'l' for the log, 'q' to quit");
     
-    // Thread-safe access to clients_ vector
-    pthread_mutex_lock(&clients_mutex);
-    for (size_t i = 0; i < clients_.size() && i < (size_t)client_height - 4; ++i) {
-        mvwprintw(client_win_, 3 + i, 1, "%s", clients_[i].c_str());
-    }
+    // Main window title
+    wattron(main_win_, A_BOLD);
+    mvwprintw(main_win_, 0, (win_width - 12) / 2, " PeerPulse ");
+    wattroff(main_win_, A_BOLD);
     
+    wnoutrefresh(main_win_);
+    draw_workers();
+    draw_status();
+}
+
+// "512B", "3.2K", "41.0M", ...
+static void format_bytes(char* out, size_t size, uint64_t bytes) {
+    const char* units = "KMGT";
+    if (bytes < 1024) {
+        snprintf(out, size, "%lluB", static_cast<unsigned long long>(bytes));
+        return;
+    }
+    double value = bytes / 1024.0;
+    int unit = 0;
+    while (value >= 1024 && unit < 3) {
+        value /= 1024;
+        unit++;
+    }
+    snprintf(out, size, "%.1f%c", value, units[unit]);
+}
+
+// Called on the render thread with ncurses_mutex held
+void TUI::draw_workers() {
+    int height = getmaxy(workers_win_);
+    int width = getmaxx(workers_win_);
+    char line[256];
+
+    werase(workers_win_);
+    box(workers_win_, 0, 0);
+
+    // Job-wide progress bar with an estimate from the average rate so far
+    wattron(workers_win_, COLOR_PAIR(3));
+    if (job_.total == 0) {
+        mvwprintw(workers_win_, 1, 1, "Job: not started, press 'r' once workers are connected");
+    } else {
+        double fraction = static_cast<double>(job_.done) / job_.total;
+        int bar_width = std::max(10, width / 3);
+        int filled = static_cast<int>(fraction * bar_width);
+
+        char eta[32] = "";
+        if (!job_.active) {
+            snprintf(eta, sizeof(eta), "done");
+        } else if (job_.done > 0) {
+            double remaining = job_.elapsed_seconds * (job_.total - job_.done) / job_.done;
+            snprintf(eta, sizeof(eta), "ETA %.0fs", remaining);
+        } else {
+            snprintf(eta, sizeof(eta), "ETA unknown");
+        }
+
+        mvwprintw(workers_win_, 1, 1, "Job: [%s%s] %5.1f%%  %llu/%llu items  %.0fs  %s",
+                  std::string(filled, '#').c_str(), std::string(bar_width - filled, '-').c_str(), fraction * 100,
+                  static_cast<unsigned long long>(job_.done), static_cast<unsigned long long>(job_.total),
+                  job_.elapsed_seconds, eta);
+    }
+
+    snprintf(line, sizeof(line), "%-3s %-21s %-7s %-5s %-19s %8s %8s %7s %7s %6s %6s",
+             "#", "Address", "State", "Tasks", "Range", "Done", "Items/s", "In", "Out", "RTT", "Heard");
+    mvwprintw(workers_win_, 2, 1, "%.*s", width - 2, line);
+    wattroff(workers_win_, COLOR_PAIR(3));
+
+    // Rows that fit, the rest are summed up on the last line
+    int rows = height - 4;
+    size_t shown = workers_.size() <= static_cast<size_t>(rows) ? workers_.size() : std::max(0, rows - 1);
+    for (size_t i = 0; i < shown; i++) {
+        const WorkerTelemetry& w = workers_[i];
+        char range[24], in[16], out[16], heard[16];
+        snprintf(range, sizeof(range), "%llu-%llu", static_cast<unsigned long long>(w.range_start),
+                 static_cast<unsigned long long>(w.range_end));
+        format_bytes(in, sizeof(in), w.bytes_in);
+        format_bytes(out, sizeof(out), w.bytes_out);
+        snprintf(heard, sizeof(heard), "%.1fs", w.since_heard_ms / 1000.0);
+
+        snprintf(line, sizeof(line), "%-3d %-21s %-7s %2zu/%-2u %-19s %8llu %8.1f %7s %7s %4llums %6s",
+                 w.index, w.address, w.state, w.running, w.slots, w.range_end > 0 ? range : "-",
+                 static_cast<unsigned long long>(w.items_done), w.items_per_sec, in, out,
+                 static_cast<unsigned long long>(w.rtt_ms), w.gone ? "-" : heard);
+
+        int attr = w.gone ? A_DIM : 0;
+        wattron(workers_win_, attr);
+        mvwprintw(workers_win_, 3 + i, 1, "%.*s", width - 2, line);
+        wattroff(workers_win_, attr);
+    }
+    if (shown < workers_.size()) {
+        mvwprintw(workers_win_, 3 + shown, 1, "... %zu more workers, %llu items done in all", workers_.size() - shown,
+                  static_cast<unsigned long long>(job_.items_done));
+    }
+
+    wnoutrefresh(workers_win_);
+}
+
+// Called on the render thread with ncurses_mutex held
+void TUI::draw_status() {
+    int status_width = getmaxx(status_win_);
+    int status_height = getmaxy(status_win_);
+
+    werase(status_win_);
+    box(status_win_, 0, 0);
+
     // Status window header
     wattron(status_win_, COLOR_PAIR(3));
     mvwprintw(status_win_, 1, 1, "Server Socket: %s", socket_address_.c_str());
-    mvwprintw(status_win_, 2, 1, "Status Messages:");
+    mvwprintw(status_win_, 2, 1, "Chunks:");
+    mvwprintw(status_win_, 3, 1, "Status Messages:");
+    size_t dropped = dropped_status_.load();
+    if (dropped > 0) {
+        wprintw(status_win_, " (%zu dropped)", dropped);
+    }
     wattroff(status_win_, COLOR_PAIR(3));
+
+    pthread_mutex_lock(&summary_mutex);
+    mvwprintw(status_win_, 2, 9, "%.*s", status_width - 10, scheduler_summary_.c_str());
+    pthread_mutex_unlock(&summary_mutex);
     
     // Display status messages with scrolling
-    int max_messages = client_height - 6; // Leave room for header and border
-    int message_start_index = 0;
+    int max_messages = status_height - 7; // Leave room for header and border
+    size_t message_start_index = 0;
     
     // If we have more messages than can fit, calculate the starting index for scrolling
-    if (status_messages_.size() > (size_t)max_messages) {
-        message_start_index = status_messages_.size() - max_messages;
+    if (status_log_.size() > (size_t)max_messages) {
+        message_start_index = status_log_.size() - max_messages;
     }
     
-    // Display the messages
-    for (size_t i = 0; i < (size_t)max_messages && i + message_start_index < status_messages_.size(); ++i) {
-        mvwprintw(status_win_, 4 + i, 1, "%s", status_messages_[i + message_start_index].c_str());
+    // Display the messages, timestamps are only formatted for what is on screen
+    char time_str[16];
+    for (size_t i = 0; i < (size_t)max_messages && i + message_start_index < status_log_.size(); ++i) {
+        const StatusRecord& record = status_log_.at(i + message_start_index);
+        record.format_time(time_str, sizeof(time_str));
+        mvwprintw(status_win_, 5 + i, 1, "%s %.*s", time_str,
+                  std::max(0, std::min<int>(record.len, status_width - 13)), record.text);
     }
-    
-    pthread_mutex_unlock(&clients_mutex);
-    
-    // Help text
-    mvwprintw(main_win_, getmaxy(main_win_) - 2, 2, "Press 'r' to start, Press 'a' to add client, 's' to view script, 'q' to quit");
-    
-    // Main window title
-    wattron(main_win_, A_BOLD);
-    mvwprintw(main_win_, 0, (win_width - 12) / 2, " PeerPulse ");
-    wattroff(main_win_, A_BOLD);
-    
-    wrefresh(main_win_);
-    wrefresh(client_win_);
-    wrefresh(status_win_);
-    update_panels();
-    doupdate();
-    
-    // Unlock the mutex after finishing ncurses operations
-    pthread_mutex_unlock(&ncurses_mutex);
+
+    wnoutrefresh(status_win_);
 }
 
-void TUI::add_client(const std::string& client_info) {
-    // Thread-safe access to clients_ vector
-    pthread_mutex_lock(&clients_mutex);
-    clients_.push_back(client_info);
-    pthread_mutex_unlock(&clients_mutex);
-    
-    // If we're on the main interface, update it to show the new client
-    if (in_main) {
-        render_main_interface();
+void TUI::render_loop() {
+    struct timespec frame = {0, 1000000000L / RENDER_FPS};
+    int frames = 0;
+
+    while (rendering_) {
+        nanosleep(&frame, nullptr);
+
+        // Workers show up and report on their own, no key press needed.
+        // Taken before the ncurses lock, the reactor holds the server's.
+        if (server_ref && frames++ % TELEMETRY_INTERVAL_FRAMES == 0) {
+            server_ref->telemetry(workers_, job_);
+            dirty_workers_ = true;
+        }
+
+        bool new_messages = drain_status();
+
+        pthread_mutex_lock(&ncurses_mutex);
+        if (!in_main) {
+            pthread_mutex_unlock(&ncurses_mutex);
+            continue;
+        }
+
+        if (dirty_layout_.exchange(false)) {
+            dirty_workers_ = false;
+            dirty_summary_ = false;
+            render_main_interface();
+        } else {
+            if (dirty_workers_.exchange(false)) {
+                draw_workers();
+            }
+            if (dirty_summary_.exchange(false) || new_messages) {
+                draw_status();
+            }
+        }
+
+        // Only the cells that changed go out to the terminal
+        update_panels();
+        doupdate();
+        pthread_mutex_unlock(&ncurses_mutex);
+    }
+}
+
+// Blocks until a key is pressed without holding the ncurses lock
+static int wait_key(pthread_mutex_t* ncurses_mutex) {
+    while (1) {
+        struct pollfd input = {STDIN_FILENO, POLLIN, 0};
+        poll(&input, 1, 1000 / RENDER_FPS);
+
+        pthread_mutex_lock(ncurses_mutex);
+        int ch = getch();
+        pthread_mutex_unlock(ncurses_mutex);
+        if (ch != ERR) {
+            return ch;
+        }
     }
 }
 
 void TUI::handle_input() {
-    // Lock mutex for ncurses operations
-    pthread_mutex_lock(&ncurses_mutex);
-    
     int ch;
-    while ((ch = getch()) != 'q') {
+    while ((ch = wait_key(&ncurses_mutex)) != 'q') {
         switch (ch) {
             case '\n':
             case KEY_ENTER:
                 if (intro_win_) {
-                    // Temporarily unlock mutex for complex operation
-                    pthread_mutex_unlock(&ncurses_mutex);
+                    pthread_mutex_lock(&ncurses_mutex);
                     destroy_intro_screen();
                     create_main_interface();
-                    pthread_mutex_lock(&ncurses_mutex);
-                    in_main=true;
-                }
-                break;
-            case 'a':
-                if (!intro_win_) {
-                    // Temporarily unlock mutex for complex operation
+                    in_main = true;
                     pthread_mutex_unlock(&ncurses_mutex);
-                    
-                    // Check for new clients when 'a' is pressed
-                    check_for_new_clients();
-                    
-                    // Refresh the main interface to show new clients
-                    render_main_interface();
-                    pthread_mutex_lock(&ncurses_mutex);
                 }
                 break;
             case 's':
                 if (!intro_win_) {
-                    // Temporarily unlock mutex for complex operation
-                    pthread_mutex_unlock(&ncurses_mutex);
                     show_script_viewer();
-                    pthread_mutex_lock(&ncurses_mutex);
-                    in_main=false;
+                }
+                break;
+            case 'l':
+                if (!intro_win_) {
+                    show_log_viewer();
                 }
                 break;
             case 'r':
-                    pthread_mutex_unlock(&ncurses_mutex);
-                    distribute_network();
-                    pthread_mutex_lock(&ncurses_mutex);
+                if (job_running_) {
+                    add_status_message("A job is already running");
+                    break;
+                }
+                if (job_joinable_) {
+                    pthread_join(job_thread_, nullptr);
+                    job_joinable_ = false;
+                }
+                job_running_ = true;
+                if (pthread_create(&job_thread_, nullptr, &TUI::job_thread_fn, this) != 0) {
+                    job_running_ = false;
+                    add_status_message("Could not start the job thread");
                     break;
+                }
+                job_joinable_ = true;
+                break;
         }
     }
     
-    // User pressed 'q' to quit
+    // User pressed 'q' to quit. The job thread uses the server and this
+    // screen, it has to be gone before either is torn down.
+    if (job_joinable_) {
+        if (job_running_ && server_ref) {
+            server_ref->cancel_job();
+        }
+        pthread_join(job_thread_, nullptr);
+        job_joinable_ = false;
+    }
     printf("Quitting application...\n");
-    
-    // Unlock mutex before exit
-    pthread_mutex_unlock(&ncurses_mutex);
 }
 
 void TUI::show_script_viewer() {
-    // Lock ncurses mutex for thread safety
+    // Lock ncurses mutex for thread safety, the render thread leaves the screen alone meanwhile
     pthread_mutex_lock(&ncurses_mutex);
+    in_main = false;
     
     // Save current main window state
     PANEL* saved_panel = main_panel_;
@@ -392,8 +494,9 @@ void TUI::show_script_viewer() {
     
     box(script_win, 0, 0);
     
-    // Sample script content as char* buffer
+    // The payload is a read-only mapping with no terminator, stay within its size
     const char* script_content = server_ref->_script_buf;
+    const char* script_end = script_content ? script_content + server_ref->get_script_size() : nullptr;
     
     // Display the script content
     wattron(script_win, COLOR_PAIR(3));
@@ -403,7 +506,7 @@ void TUI::show_script_viewer() {
     // Parse and display the buffer line by line
     int current_line = 3;
     const char* start = script_content;
-    const char* end = strchr(start, '\n');
+    const char* end = start ? static_cast<const char*>(memchr(start, '\n', script_end - start)) : nullptr;
     
     while (end != nullptr && current_line < height - 2) {
         // Calculate line length (without the newline)
@@ -421,12 +524,12 @@ void TUI::show_script_viewer() {
         // Move to next line
         current_line++;
         start = end + 1; // Skip the newline
-        end = strchr(start, '\n');
+        end = static_cast<const char*>(memchr(start, '\n', script_end - start));
     }
     
     // Print any remaining content after last newline
-    if (start != nullptr && *start != '\0' && current_line < height - 2) {
-        int remaining_length = strlen(start);
+    if (start != nullptr && start < script_end && current_line < height - 2) {
+        int remaining_length = script_end - start;
         int max_line_length = width - 4;
         if (remaining_length > max_line_length) {
             remaining_length = max_line_length;
@@ -445,24 +548,102 @@ void TUI::show_script_viewer() {
     wrefresh(script_win);
     update_panels();
     doupdate();
+    pthread_mutex_unlock(&ncurses_mutex);
     
     // Wait for a key press
-    getch();
+    wait_key(&ncurses_mutex);
     
     // Clean up and restore original window
+    pthread_mutex_lock(&ncurses_mutex);
     del_panel(script_panel);
     delwin(script_win);
     
-    // Restore main interface
+    // Restore main interface, redrawn in full on the next frame
     top_panel(saved_panel);
-    update_panels();
-    wrefresh(saved_win);
-    doupdate();
+    touchwin(saved_win);
+    in_main = true;
+    dirty_layout_ = true;
     
     // Unlock ncurses mutex
     pthread_mutex_unlock(&ncurses_mutex);
 }
 
+void TUI::show_log_viewer() {
+    // The render thread flushes the log every frame, read what is there now
+    std::string content;
+    FILE* log = fopen(STATUS_LOG_FILE, "r");
+    if (log) {
+        char buf[64 * 1024];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), log)) > 0) {
+            content.append(buf, n);
+        }
+        fclose(log);
+    }
+
+    std::vector<size_t> line_starts;
+    for (size_t pos = 0; pos < content.size(); pos++) {
+        if (pos == 0 || content[pos - 1] == '\n') {
+            line_starts.push_back(pos);
+        }
+    }
+
+    pthread_mutex_lock(&ncurses_mutex);
+    in_main = false;
+    int height = term_height_ - 2;
+    int width = term_width_ - 2;
+    WINDOW* log_win = newwin(height, width, 1, 1);
+    PANEL* log_panel = new_panel(log_win);
+    pthread_mutex_unlock(&ncurses_mutex);
+
+    // Starts at the newest messages
+    int rows = height - 4;
+    long last_top = std::max<long>(0, static_cast<long>(line_starts.size()) - rows);
+    long top = last_top;
+    int ch = 0;
+
+    do {
+        switch (ch) {
+            case KEY_UP: case 'k': top--; break;
+            case KEY_DOWN: case 'j': top++; break;
+            case KEY_PPAGE: top -= rows; break;
+            case KEY_NPAGE: case ' ': top += rows; break;
+            case KEY_HOME: case 'g': top = 0; break;
+            case KEY_END: case 'G': top = last_top; break;
+        }
+        top = std::max<long>(0, std::min(top, last_top));
+
+        pthread_mutex_lock(&ncurses_mutex);
+        werase(log_win);
+        box(log_win, 0, 0);
+        wattron(log_win, A_BOLD);
+        mvwprintw(log_win, 0, (width - 14) / 2, " Status Log ");
+        wattroff(log_win, A_BOLD);
+
+        for (int row = 0; row < rows && top + row < static_cast<long>(line_starts.size()); row++) {
+            size_t start = line_starts[top + row];
+            size_t end = content.find('\n', start);
+            int len = static_cast<int>((end == std::string::npos ? content.size() : end) - start);
+            mvwprintw(log_win, 1 + row, 2, "%.*s", std::min(len, width - 4), content.data() + start);
+        }
+        mvwprintw(log_win, height - 2, 2, "%s: lines %ld-%ld of %zu, arrows/PgUp/PgDn to scroll, 'q' to return",
+                  STATUS_LOG_FILE, line_starts.empty() ? 0 : top + 1,
+                  std::min<long>(top + rows, line_starts.size()), line_starts.size());
+
+        update_panels();
+        doupdate();
+        pthread_mutex_unlock(&ncurses_mutex);
+    } while ((ch = wait_key(&ncurses_mutex)) != 'q' && ch != 27);
+
+    pthread_mutex_lock(&ncurses_mutex);
+    del_panel(log_panel);
+    delwin(log_win);
+    touchwin(main_win_);
+    in_main = true;
+    dirty_layout_ = true;
+    pthread_mutex_unlock(&ncurses_mutex);
+}
+
 void TUI::distribute_network() {
     // Add example status messages
     add_status_message("Starting network distribution...");
@@ -473,43 +654,96 @@ void TUI::distribute_network() {
         add_status_message("Waiting for peer connections...");
         
         // Check For Any clients
+        // The thread is joined on quit, it returns rather than exits
         int err = server_ref->send_files();
         if (err != 0) {
-                exit(-1);
+            add_status_message("Network distribution could not be started");
+            return;
         }
         err = server_ref->recv_output();
     } else {
         add_status_message("Could not access server");
         add_status_message("Network distribution could not be started");
-        exit(0);
     }
 }
 
+void TUI::set_scheduler_summary(const std::string& summary) {
+    pthread_mutex_lock(&summary_mutex);
+    scheduler_summary_ = summary;
+    pthread_mutex_unlock(&summary_mutex);
+    dirty_summary_ = true;
+}
+
 void TUI::add_status_message(const std::string& message) {
-    // Thread-safe access to status_messages_ vector
-    pthread_mutex_lock(&clients_mutex);
-    
-    // Add timestamp to the message
-    time_t current_time;
-    char time_str[10];
-    time(&current_time);
-    strftime(time_str, sizeof(time_str), "[%H:%M:%S]", localtime(&current_time));
-    
-    std::string timestamped_message = std::string(time_str) + " " + message;
-    status_messages_.push_back(timestamped_message);
-    
-    // Keep a maximum of 100 messages (to prevent memory issues)
-    if (status_messages_.size() > 100) {
-        status_messages_.erase(status_messages_.begin());
+    // A raw timestamp and a copy of the text, formatting waits for display
+    StatusRecord record;
+    record.set(message);
+    if (message.size() > STATUS_TEXT_SIZE) {
+        record.tail = new std::string(message, STATUS_TEXT_SIZE);
     }
-    
-    pthread_mutex_unlock(&clients_mutex);
-    
-    // If we're on the main interface, update it to show the new message
-    render_main_interface();
+
+    // Drawn on the next frame. A full queue means the screen cannot keep
+    // up anyway, the message is counted for the screen and set aside for
+    // the log instead of waited for.
+    if (!overflowing_.load(std::memory_order_relaxed) && pending_status_.push(std::move(record))) {
+        return;
+    }
+    dropped_status_++;
+    pthread_mutex_lock(&overflow_mutex);
+    overflowing_ = true;
+    overflow_status_.push_back(record);
+    pthread_mutex_unlock(&overflow_mutex);
+}
+
+// Called on the render thread, or once it is gone. Formats the time only
+// here, far from the threads raising messages.
+void TUI::log_status(StatusRecord& record) {
+    if (log_file_) {
+        char time_str[32];
+        struct tm local;
+        localtime_r(&record.when, &local);
+        strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", &local);
+        fprintf(log_file_, "%s %.*s%s\n", time_str, record.len, record.text,
+                record.tail ? record.tail->c_str() : "");
+    }
+    delete record.tail;
+    record.tail = nullptr;
+}
+
+// Everything raised since the last frame goes into the log, what the
+// queue took is drawn as well. True when there is something new to draw.
+bool TUI::drain_status() {
+    StatusRecord record;
+    bool new_messages = false;
+    while (pending_status_.pop(record)) {
+        log_status(record);
+        status_log_.push(record);
+        new_messages = true;
+    }
+
+    if (overflowing_.load()) {
+        std::vector<StatusRecord> overflow;
+        pthread_mutex_lock(&overflow_mutex);
+        overflow.swap(overflow_status_);
+        overflowing_ = false;
+        pthread_mutex_unlock(&overflow_mutex);
+        for (StatusRecord& late : overflow) {
+            log_status(late);
+        }
+    }
+
+    if (log_file_) {
+        fflush(log_file_);
+    }
+    return new_messages;
 }
 
 void TUI::run() {
     create_intro_screen();
+
+    rendering_ = true;
+    pthread_create(&render_thread_, nullptr, &TUI::render_thread_fn, this);
     handle_input();
+    rendering_ = false;
+    pthread_join(render_thread_, nullptr);
 }
@@ -0,0 +1,47 @@
+#include <iostream>
+#include <string.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <worker.h>
+
+int main(int argc, char** argv) {
+    // A coordinator that goes away must show up as a send error
+    signal(SIGPIPE, SIG_IGN);
+
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <server host> [port] [--python=PATH] "
+                  << "[--cache-dir=DIR] [--cache-bytes=N] [--slots=N] [--benchmark] [--warm]" << std::endl;
+        return 1;
+    }
+
+    WorkerConfig config;
+    config.host = argv[1];
+
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.rfind("--python=", 0) == 0) {
+            config.python = arg.substr(strlen("--python="));
+        } else if (arg.rfind("--cache-dir=", 0) == 0) {
+            config.cache_dir = arg.substr(strlen("--cache-dir="));
+        } else if (arg.rfind("--cache-bytes=", 0) == 0) {
+            config.cache_bytes = strtoull(arg.c_str() + strlen("--cache-bytes="), nullptr, 10);
+        } else if (arg.rfind("--slots=", 0) == 0) {
+            config.slots = atoi(arg.c_str() + strlen("--slots="));
+        } else if (arg == "--benchmark") {
+            config.benchmark = true;
+        } else if (arg == "--warm") {
+            config.warm = true;
+        } else if (arg[0] != '-') {
+            config.port = atoi(arg.c_str());
+        } else {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            return 1;
+        }
+    }
+
+    // Line buffered so progress shows up promptly when logged to a file
+    setvbuf(stdout, nullptr, _IOLBF, 0);
+
+    PeerWorker worker(config);
+    return worker.run();
+}
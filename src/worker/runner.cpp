@@ -0,0 +1,258 @@
+#include <worker.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+
+extern char **environ;
+
+// Records a runner writes back: uint32 task id, uint8 kind, uint32 value.
+// Kind 0 is output followed by value bytes, kind 1 ends the task with
+// value as its exit status.
+constexpr size_t RUNNER_RECORD_SIZE = 9;
+
+// Compiles the payload once, then runs it as __main__ for every range read
+// from stdin. The real stdin and stdout become the request and record
+// channels, the task sees /dev/null and stderr instead so stray writes
+// cannot corrupt them.
+static const char* RUNNER_SOURCE = R"PY(
+import io, os, struct, sys, traceback
+RECORD = struct.Struct("!IBI")
+path = sys.argv[1]
+with open(path, "rb") as f:
+    code = compile(f.read(), path, "exec")
+
+requests = os.fdopen(os.dup(0), "rb")
+channel = os.dup(1)
+os.dup2(os.open(os.devnull, os.O_RDONLY), 0)
+os.dup2(2, 1)
+
+def send(data):
+    view = memoryview(data)
+    while view:
+        view = view[os.write(channel, view):]
+
+class Output(io.RawIOBase):
+    task = 0
+    def writable(self):
+        return True
+    def write(self, b):
+        send(RECORD.pack(self.task, 0, len(b)) + bytes(b))
+        return len(b)
+
+raw = Output()
+out = io.TextIOWrapper(io.BufferedWriter(raw, 65536))
+for line in requests:
+    task_id, lower, upper = (int(x) for x in line.split())
+    os.environ["PROCESS_BOUND_LOWER"] = str(lower)
+    os.environ["PROCESS_BOUND_UPPER"] = str(upper)
+    raw.task = task_id
+    sys.stdout = out
+    status = 0
+    try:
+        exec(code, {"__name__": "__main__", "__file__": path, "__builtins__": __builtins__})
+    except SystemExit as e:
+        status = e.code if isinstance(e.code, int) else (0 if e.code is None else 1)
+    except BaseException:
+        traceback.print_exc()
+        status = 1
+    out.flush()
+    send(RECORD.pack(task_id, 1, status & 0xFFFFFFFF))
+)PY";
+
+bool PeerWorker::spawn_runner(WarmRunner& runner, const std::string& script) {
+    int requests[2];
+    int records[2];
+    if (pipe2(requests, O_CLOEXEC) < 0) {
+        perror("pipe");
+        return false;
+    }
+    if (pipe2(records, O_CLOEXEC) < 0 || fcntl(records[0], F_SETFL, O_NONBLOCK) < 0) {
+        perror("pipe");
+        close(requests[0]);
+        close(requests[1]);
+        return false;
+    }
+
+    std::string path = script;
+    char dash_c[] = "-c";
+    char* argv[] = {&config.python[0], dash_c, const_cast<char*>(RUNNER_SOURCE), &path[0], nullptr};
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(requests[0], STDIN_FILENO);
+        dup2(records[1], STDOUT_FILENO);
+        execvpe(argv[0], argv, environ);
+        _exit(127);
+    }
+    close(requests[0]);
+    close(records[1]);
+
+    if (pid < 0) {
+        perror("fork");
+        close(requests[1]);
+        close(records[0]);
+        return false;
+    }
+
+    runner.pid = pid;
+    runner.in_fd = requests[1];
+    runner.out_fd = records[0];
+    runner.script = script;
+    runner.pending.clear();
+    runner.busy = false;
+    printf("Started warm runner %d for %s\n", pid, script.c_str());
+    return true;
+}
+
+void PeerWorker::stop_runner(WarmRunner& runner) {
+    if (runner.pid < 0) {
+        return;
+    }
+    kill(runner.pid, SIGKILL);
+    waitpid(runner.pid, nullptr, 0);
+    close(runner.in_fd);
+    close(runner.out_fd);
+    runner = WarmRunner();
+}
+
+bool PeerWorker::start_warm(const TaskRange& range, const std::string& script) {
+    // An idle runner that already has this payload, else an empty slot,
+    // else an idle runner holding an older payload
+    WarmRunner* chosen = nullptr;
+    for (WarmRunner& runner : runners) {
+        if (runner.pid >= 0 && !runner.busy && runner.script == script) {
+            chosen = &runner;
+            break;
+        }
+    }
+    for (size_t i = 0; !chosen && i < runners.size(); i++) {
+        if (runners[i].pid < 0) {
+            chosen = &runners[i];
+        }
+    }
+    for (size_t i = 0; !chosen && i < runners.size(); i++) {
+        if (!runners[i].busy) {
+            stop_runner(runners[i]);
+            chosen = &runners[i];
+        }
+    }
+
+    if (!chosen || (chosen->pid < 0 && !spawn_runner(*chosen, script))) {
+        TaskDone done = {range.task_id, TASK_NOT_RUN, 0};
+        return send_done(done);
+    }
+
+    std::string request = std::to_string(range.task_id) + " " + std::to_string(range.start) + " " +
+                          std::to_string(range.end) + "\n";
+    if (write(chosen->in_fd, request.data(), request.size()) != static_cast<ssize_t>(request.size())) {
+        perror("runner request");
+        stop_runner(*chosen);
+        TaskDone done = {range.task_id, TASK_NOT_RUN, 0};
+        return send_done(done);
+    }
+
+    chosen->busy = true;
+    chosen->task_id = range.task_id;
+    chosen->bytes_sent = 0;
+    printf("Executing task %u over [%llu, %llu) in runner %d\n", range.task_id,
+           static_cast<unsigned long long>(range.start), static_cast<unsigned long long>(range.end), chosen->pid);
+    return true;
+}
+
+bool PeerWorker::send_output(uint32_t task_id, const char* data, size_t len) {
+    if (aggregating) {
+        fold_output(task_id, data, len);
+        return true;
+    }
+
+    // Task id in front of every RESULT_CHUNK, so large records go out in pieces
+    uint32_t net_id = htonl(task_id);
+    memcpy(io_buf, &net_id, sizeof(net_id));
+
+    while (len > 0) {
+        size_t n = std::min(len, WORKER_CHUNK_SIZE - 4);
+        memcpy(io_buf + 4, data, n);
+
+        pthread_mutex_lock(&send_mutex);
+        bool ok = conn.send_frame(MsgType::RESULT_CHUNK, io_buf, n + 4);
+        pthread_mutex_unlock(&send_mutex);
+        if (!ok) {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool PeerWorker::pump_runner(size_t slot) {
+    WarmRunner& runner = runners[slot];
+
+    ssize_t n = read(runner.out_fd, io_buf, WORKER_CHUNK_SIZE);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return true;
+    }
+
+    if (n <= 0) {
+        // The runner died, a task it had is reported as not run so its range
+        // goes out again. The slot gets a fresh runner later.
+        bool ok = true;
+        if (runner.busy) {
+            fprintf(stderr, "Runner %d exited during task %u\n", runner.pid, runner.task_id);
+            TaskDone done = {runner.task_id, TASK_NOT_RUN, runner.bytes_sent};
+            ok = send_done(done);
+        }
+        stop_runner(runner);
+        start_waiting();
+        return ok;
+    }
+    runner.pending.append(io_buf, n);
+
+    // io_buf is free again, send_output() reuses it
+    size_t off = 0;
+    bool finished = false;
+    while (runner.pending.size() - off >= RUNNER_RECORD_SIZE) {
+        const char* record = runner.pending.data() + off;
+        uint32_t task_id = get_u32(record);
+        uint8_t kind = static_cast<uint8_t>(record[4]);
+        uint32_t value = get_u32(record + 5);
+        bool current = runner.busy && task_id == runner.task_id;
+
+        if (kind == 0) {
+            if (runner.pending.size() - off - RUNNER_RECORD_SIZE < value) {
+                break;
+            }
+            if (current) {
+                if (!send_output(task_id, record + RUNNER_RECORD_SIZE, value)) {
+                    return false;
+                }
+                runner.bytes_sent += value;
+            }
+            off += RUNNER_RECORD_SIZE + value;
+            continue;
+        }
+
+        off += RUNNER_RECORD_SIZE;
+        if (current) {
+            TaskDone done = {task_id, static_cast<int32_t>(value), runner.bytes_sent};
+            printf("Task %u finished with status %d, %llu bytes\n", task_id, done.status,
+                   static_cast<unsigned long long>(runner.bytes_sent));
+            runner.busy = false;
+            finished = true;
+            if (!send_done(done)) {
+                return false;
+            }
+        }
+    }
+    runner.pending.erase(0, off);
+
+    if (finished) {
+        start_waiting();
+    }
+    return true;
+}
@@ -0,0 +1,844 @@
+#include <worker.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <dirent.h>
+#include <netdb.h>
+#include <utime.h>
+#include <algorithm>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+extern char **environ;
+
+static uint64_t monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool make_dirs(const std::string& path) {
+    for (size_t pos = 1; pos <= path.size(); pos++) {
+        if (pos == path.size() || path[pos] == '/') {
+            std::string prefix = path.substr(0, pos);
+            if (mkdir(prefix.c_str(), 0755) < 0 && errno != EEXIST) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static int connect_endpoint(const Endpoint& endpoint) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = endpoint.addr;
+    address.sin_port = htons(endpoint.port);
+
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Reads a whole (small) payload after its header has been consumed
+static bool read_payload(Client& source, uint32_t length, std::string& payload) {
+    payload.resize(length);
+    size_t received = 0;
+
+    while (received < length) {
+        ssize_t n = source.recv_some(&payload[received], length - received);
+        if (n <= 0) {
+            return false;
+        }
+        received += n;
+    }
+    return true;
+}
+
+// Single core integer workload, iterations per millisecond over a short run
+static uint32_t run_benchmark() {
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    volatile uint64_t sink = 0;
+    uint64_t iterations = 0;
+    double elapsed_ms = 0;
+
+    while (elapsed_ms < BENCHMARK_MS) {
+        uint64_t x = iterations + 1;
+        for (int i = 0; i < 100000; i++) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+        }
+        sink = sink + x;
+        iterations += 100000;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed_ms = (now.tv_sec - start.tv_sec) * 1000.0 + (now.tv_nsec - start.tv_nsec) / 1e6;
+    }
+    return static_cast<uint32_t>(iterations / elapsed_ms);
+}
+
+PeerWorker::PeerWorker(const WorkerConfig& config) : config(config) {
+    if (this->config.cache_dir.empty()) {
+        const char* home = getenv("HOME");
+        this->config.cache_dir = std::string(home ? home : "/tmp") + "/.cache/peerpulse/payloads";
+    }
+    if (this->config.slots <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        this->config.slots = cores > 0 ? static_cast<int>(cores) : 1;
+    }
+    if (this->config.warm) {
+        runners.resize(this->config.slots);
+    }
+    io_buf = new char[WORKER_CHUNK_SIZE];
+    upstream.client_fd = -1;
+}
+
+PeerWorker::~PeerWorker() {
+    for (RunningTask& task : running) {
+        kill(task.pid, SIGKILL);
+        waitpid(task.pid, nullptr, 0);
+        close(task.out_fd);
+    }
+    for (WarmRunner& runner : runners) {
+        stop_runner(runner);
+    }
+    if (conn.client_fd >= 0) {
+        close(conn.client_fd);
+    }
+    if (relay_fd >= 0) {
+        close(relay_fd);
+    }
+    if (upstream.client_fd >= 0) {
+        close(upstream.client_fd);
+    }
+    delete[] io_buf;
+}
+
+bool PeerWorker::send_control(MsgType type, const std::string& payload) {
+    pthread_mutex_lock(&send_mutex);
+    bool ok = conn.send_frame(type, payload.data(), payload.size());
+    pthread_mutex_unlock(&send_mutex);
+    return ok;
+}
+
+bool PeerWorker::send_done(TaskDone done) {
+    // A folded task sent nothing, its output leaves with the next partial.
+    // One that never ran to the end has nothing worth folding.
+    if (aggregating) {
+        pthread_mutex_lock(&aggregate_mutex);
+        if (done.status == TASK_NOT_RUN) {
+            reducer.abort(done.task_id);
+        } else {
+            reducer.commit(done.task_id);
+            folded.push_back(done.task_id);
+        }
+        pthread_mutex_unlock(&aggregate_mutex);
+        done.bytes = 0;
+    }
+    return send_control(MsgType::DONE, encode_done(done));
+}
+
+void PeerWorker::fold_output(uint32_t task_id, const char* data, size_t len) {
+    pthread_mutex_lock(&aggregate_mutex);
+    reducer.append(task_id, data, len);
+    pthread_mutex_unlock(&aggregate_mutex);
+}
+
+void PeerWorker::set_aggregate(const AggregatePlan& plan) {
+    ReduceOp op = static_cast<ReduceOp>(plan.op);
+    bool enable = op != ReduceOp::CONCAT;
+
+    // Moved under another parent, everything folded so far is still good
+    if (aggregating && enable && op == reducer.get_op() && plan.k == reducer.get_k()) {
+        pthread_mutex_lock(&aggregate_mutex);
+        parent = plan.parent;
+        pthread_mutex_unlock(&aggregate_mutex);
+        printf("Partials now go to %s\n", plan.parent.port != 0 ? "a new parent" : "the coordinator");
+        return;
+    }
+
+    // A new job, whatever the last one left behind goes first
+    flush_partials(true);
+    pthread_mutex_lock(&aggregate_mutex);
+    reducer.configure(op, plan.k);
+    reducer.reset();
+    folded.clear();
+    parent = plan.parent;
+    aggregating = enable;
+    pthread_mutex_unlock(&aggregate_mutex);
+
+    if (enable) {
+        struct in_addr addr = {plan.parent.addr};
+        printf("Folding output with %s, partials to %s\n", reduce_name(op),
+               plan.parent.port != 0 ? (std::string(inet_ntoa(addr)) + ":" + std::to_string(plan.parent.port)).c_str() :
+                                       "the coordinator");
+    }
+}
+
+// Sends what was folded since the last flush to the parent aggregator, or
+// to the coordinator when there is none or it cannot be reached
+bool PeerWorker::flush_partials(bool force) {
+    uint64_t now = monotonic_ms();
+    pthread_mutex_lock(&aggregate_mutex);
+    if (!aggregating || folded.empty() || (!force && now - last_flush_ms < AGGREGATE_FLUSH_MS)) {
+        pthread_mutex_unlock(&aggregate_mutex);
+        return true;
+    }
+    std::vector<uint32_t> task_ids;
+    task_ids.swap(folded);
+    std::string payload = encode_partial_batch(task_ids, reducer.take());
+    Endpoint to = parent;
+    pthread_mutex_unlock(&aggregate_mutex);
+    last_flush_ms = now;
+
+    if (to.port != 0) {
+        if (upstream.client_fd >= 0 && !(upstream_to == to)) {
+            close(upstream.client_fd);
+            upstream.client_fd = -1;
+        }
+        if (upstream.client_fd < 0) {
+            upstream.client_fd = connect_endpoint(to);
+            upstream_to = to;
+        }
+        if (upstream.client_fd >= 0 && upstream.send_frame(MsgType::PARTIAL, payload.data(), payload.size())) {
+            return true;
+        }
+
+        // The coordinator learns from its own connection that the parent is
+        // gone, and reruns whatever the parent already took
+        fprintf(stderr, "Parent aggregator unreachable, sending partials to the coordinator\n");
+        if (upstream.client_fd >= 0) {
+            close(upstream.client_fd);
+            upstream.client_fd = -1;
+        }
+        pthread_mutex_lock(&aggregate_mutex);
+        if (parent == to) {
+            parent = {0, 0};
+        }
+        pthread_mutex_unlock(&aggregate_mutex);
+    }
+    return send_control(MsgType::PARTIAL, payload);
+}
+
+std::string PeerWorker::cache_path(const std::string& digest) {
+    return config.cache_dir + "/" + digest_hex(digest) + ".py";
+}
+
+std::string PeerWorker::cache_lookup(const std::string& digest) {
+    // Touching the entry marks it as recently used
+    std::string path = cache_path(digest);
+    return utime(path.c_str(), nullptr) == 0 ? path : std::string();
+}
+
+void PeerWorker::cache_trim(const std::string& keep) {
+    struct Entry {
+        time_t mtime;
+        off_t size;
+        std::string path;
+    };
+    std::vector<Entry> entries;
+    uint64_t total = 0;
+
+    DIR* dir = opendir(config.cache_dir.c_str());
+    if (!dir) {
+        return;
+    }
+    while (struct dirent* ent = readdir(dir)) {
+        if (ent->d_name[0] == '.') {
+            continue;  // Skips in-progress downloads too
+        }
+        std::string path = config.cache_dir + "/" + ent->d_name;
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+            entries.push_back({st.st_mtime, st.st_size, path});
+            total += st.st_size;
+        }
+    }
+    closedir(dir);
+
+    // Least recently used first
+    std::sort(entries.begin(), entries.end(),
+              [](const Entry& a, const Entry& b) { return a.mtime < b.mtime; });
+    for (const Entry& entry : entries) {
+        if (total <= config.cache_bytes) {
+            break;
+        }
+        if (entry.path != keep && unlink(entry.path.c_str()) == 0) {
+            total -= entry.size;
+        }
+    }
+}
+
+std::string PeerWorker::receive_payload(Client& source, uint32_t length, const RelayPlan* relay) {
+    std::vector<Client> children;
+    std::vector<std::vector<Endpoint>> child_subtrees;
+    std::vector<Endpoint> failed;
+
+    // Open the relay connections first so every chunk is forwarded on arrival
+    if (relay) {
+        size_t n = relay->descendants.size();
+        size_t k = relay->fanout;
+
+        for (size_t pos = 1; pos <= k && pos <= n; pos++) {
+            std::vector<Endpoint> subtree(1, relay->descendants[pos - 1]);
+            RelayPlan child_plan;
+            child_plan.fanout = relay->fanout;
+            for (size_t sub : relay_subtree(pos, n, k)) {
+                child_plan.descendants.push_back(relay->descendants[sub - 1]);
+                subtree.push_back(relay->descendants[sub - 1]);
+            }
+
+            Client child;
+            child.client_fd = connect_endpoint(subtree[0]);
+            char header[FRAME_HEADER_SIZE];
+            encode_header(header, MsgType::SCRIPT, length);
+            std::string relay_payload = encode_relay_plan(child_plan);
+
+            if (child.client_fd < 0 ||
+                (!child_plan.descendants.empty() &&
+                 !child.send_frame(MsgType::RELAY, relay_payload.data(), relay_payload.size())) ||
+                child.send_buf(header, sizeof(header)) != sizeof(header)) {
+                perror("relay connect failed");
+                if (child.client_fd >= 0) {
+                    close(child.client_fd);
+                }
+                failed.insert(failed.end(), subtree.begin(), subtree.end());
+                continue;
+            }
+            children.push_back(child);
+            child_subtrees.push_back(subtree);
+        }
+    }
+
+    if (!make_dirs(config.cache_dir)) {
+        perror("cache directory");
+    }
+    std::string temp_path = config.cache_dir + "/.incoming-XXXXXX";
+    int temp_fd = mkstemp(&temp_path[0]);
+    if (temp_fd < 0) {
+        perror("mkstemp");
+    }
+
+    // One buffer per transfer, relay threads receive concurrently
+    std::vector<char> buf(WORKER_CHUNK_SIZE);
+    PayloadHasher hasher;
+    uint64_t remaining = length;
+    bool ok = temp_fd >= 0;
+
+    while (remaining > 0) {
+        ssize_t n = source.recv_some(buf.data(), std::min<uint64_t>(buf.size(), remaining));
+        if (n <= 0) {
+            ok = false;
+            break;
+        }
+        remaining -= n;
+        hasher.update(buf.data(), n);
+
+        if (ok && write(temp_fd, buf.data(), n) != n) {
+            perror("payload write");
+            ok = false;
+        }
+
+        for (size_t i = 0; i < children.size(); i++) {
+            if (children[i].client_fd >= 0 && children[i].send_buf(buf.data(), n) != static_cast<size_t>(n)) {
+                close(children[i].client_fd);
+                children[i].client_fd = -1;
+                failed.insert(failed.end(), child_subtrees[i].begin(), child_subtrees[i].end());
+            }
+        }
+    }
+
+    for (Client& child : children) {
+        if (child.client_fd >= 0) {
+            close(child.client_fd);
+        }
+    }
+    if (!failed.empty()) {
+        send_control(MsgType::RELAY_FAILED, encode_endpoints(failed));
+    }
+    if (temp_fd >= 0) {
+        close(temp_fd);
+    }
+
+    std::string digest = hasher.digest();
+    pthread_mutex_lock(&state_mutex);
+    bool matches = digest == offered;
+    pthread_mutex_unlock(&state_mutex);
+
+    if (!ok || !matches) {
+        fprintf(stderr, "Discarding payload: %s\n", ok ? "hash mismatch" : "transfer failed");
+        unlink(temp_path.c_str());
+        return std::string();
+    }
+
+    std::string path = cache_path(digest);
+    if (rename(temp_path.c_str(), path.c_str()) < 0) {
+        perror("cache rename");
+        unlink(temp_path.c_str());
+        return std::string();
+    }
+    cache_trim(path);
+    return path;
+}
+
+bool PeerWorker::start_relay_listener() {
+    relay_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (relay_fd < 0) {
+        return false;
+    }
+
+    struct sockaddr_in address;
+    socklen_t length = sizeof(address);
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = 0;  // Any free port, advertised in HELLO
+
+    if (bind(relay_fd, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+        listen(relay_fd, SOMAXCONN) < 0 ||
+        getsockname(relay_fd, (struct sockaddr*)&address, &length) < 0) {
+        perror("relay listener");
+        close(relay_fd);
+        relay_fd = -1;
+        return false;
+    }
+    relay_port = ntohs(address.sin_port);
+
+    pthread_create(&relay_thread, nullptr, &PeerWorker::relay_thread_fn, this);
+    pthread_detach(relay_thread);
+    return true;
+}
+
+void PeerWorker::relay_loop() {
+    while (1) {
+        int fd = accept4(relay_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            return;
+        }
+
+        pthread_t thread;
+        PeerArgs* args = new PeerArgs{this, fd};
+        if (pthread_create(&thread, nullptr, &PeerWorker::peer_thread_fn, args) != 0) {
+            close(fd);
+            delete args;
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
+
+void PeerWorker::serve_peer(int fd) {
+    Client peer;
+    peer.client_fd = fd;
+    RelayPlan relay;
+    bool have_relay = false;
+    MsgType type;
+    uint32_t length;
+
+    while (peer.recv_header(type, length)) {
+        if (type == MsgType::RELAY) {
+            std::string payload;
+            if (!read_payload(peer, length, payload) || !decode_relay_plan(payload, relay)) {
+                break;
+            }
+            have_relay = true;
+        } else if (type == MsgType::SCRIPT) {
+            std::string path = receive_payload(peer, length, have_relay ? &relay : nullptr);
+            if (path.empty()) {
+                break;
+            }
+
+            pthread_mutex_lock(&state_mutex);
+            script_path = path;
+            PayloadStatus status = {offered, true};
+            pthread_mutex_unlock(&state_mutex);
+
+            printf("Received %u byte script from a peer\n", length);
+            send_control(MsgType::PAYLOAD_STATUS, encode_payload_status(status));
+            break;
+        } else if (type == MsgType::PARTIAL) {
+            // A child in the aggregation tree, it keeps the connection for the next one
+            std::string payload;
+            std::vector<uint32_t> task_ids;
+            Partial partial;
+            if (!read_payload(peer, length, payload) || !decode_partial_batch(payload, task_ids, partial)) {
+                break;
+            }
+
+            pthread_mutex_lock(&aggregate_mutex);
+            bool folding = aggregating;
+            if (folding) {
+                reducer.absorb(partial);
+                folded.insert(folded.end(), task_ids.begin(), task_ids.end());
+            }
+            pthread_mutex_unlock(&aggregate_mutex);
+
+            // No longer part of the tree, the coordinator sorts it out
+            if (!folding) {
+                send_control(MsgType::PARTIAL, payload);
+            }
+        } else {
+            break;
+        }
+    }
+    close(fd);
+}
+
+bool PeerWorker::handle_frame(Frame& frame) {
+    switch (frame.type) {
+        case MsgType::PAYLOAD_OFFER: {
+            PayloadOffer offer;
+            if (!decode_payload_offer(frame.payload, offer)) {
+                return false;
+            }
+
+            pthread_mutex_lock(&state_mutex);
+            offered = offer.digest;
+            script_path = cache_lookup(offer.digest);
+            PayloadStatus status = {offer.digest, !script_path.empty()};
+            pthread_mutex_unlock(&state_mutex);
+
+            if (status.cached) {
+                printf("Payload %s found in cache\n", digest_hex(offer.digest).substr(0, 12).c_str());
+            }
+            return send_control(MsgType::PAYLOAD_STATUS, encode_payload_status(status));
+        }
+        case MsgType::RELAY:
+            have_plan = decode_relay_plan(frame.payload, plan);
+            return true;
+        case MsgType::TASK_RANGE: {
+            TaskRange range;
+            if (!decode_task_range(frame.payload, range)) {
+                return false;
+            }
+            waiting.push_back(range);
+            start_waiting();
+            return true;
+        }
+        case MsgType::CANCEL:
+            if (frame.payload.size() == 4) {
+                cancel_task(get_u32(frame.payload.data()));
+            }
+            return true;
+        case MsgType::AGGREGATE: {
+            AggregatePlan plan;
+            if (!decode_aggregate_plan(frame.payload, plan)) {
+                return false;
+            }
+            set_aggregate(plan);
+            return true;
+        }
+        case MsgType::HEARTBEAT:
+            return send_control(MsgType::HEARTBEAT, frame.payload);
+        default:
+            fprintf(stderr, "Ignoring message type %d\n", static_cast<int>(frame.type));
+            return true;
+    }
+}
+
+bool PeerWorker::start_task(const TaskRange& range) {
+    if (aggregating) {
+        pthread_mutex_lock(&aggregate_mutex);
+        reducer.begin(range.task_id);
+        pthread_mutex_unlock(&aggregate_mutex);
+    }
+
+    pthread_mutex_lock(&state_mutex);
+    std::string script = script_path;
+    pthread_mutex_unlock(&state_mutex);
+
+    if (script.empty()) {
+        fprintf(stderr, "Task %u received before any script\n", range.task_id);
+        TaskDone done = {range.task_id, TASK_NOT_RUN, 0};
+        return send_done(done);
+    }
+    if (config.warm) {
+        return start_warm(range, script);
+    }
+
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) < 0) {
+        perror("pipe");
+        TaskDone done = {range.task_id, TASK_NOT_RUN, 0};
+        return send_done(done);
+    }
+
+    // Build argv and envp before forking, the child only calls exec
+    std::string lower = "PROCESS_BOUND_LOWER=" + std::to_string(range.start);
+    std::string upper = "PROCESS_BOUND_UPPER=" + std::to_string(range.end);
+    std::vector<char*> envp;
+    for (char** env = environ; *env; env++) {
+        if (strncmp(*env, "PROCESS_BOUND_", 14) != 0) {
+            envp.push_back(*env);
+        }
+    }
+    envp.push_back(&lower[0]);
+    envp.push_back(&upper[0]);
+    envp.push_back(nullptr);
+    char* argv[] = {&config.python[0], &script[0], nullptr};
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(pipe_fds[1], STDOUT_FILENO);
+        execvpe(argv[0], argv, envp.data());
+        _exit(127);
+    }
+    close(pipe_fds[1]);
+
+    if (pid < 0) {
+        perror("fork");
+        close(pipe_fds[0]);
+        TaskDone done = {range.task_id, TASK_NOT_RUN, 0};
+        return send_done(done);
+    }
+
+    printf("Executing task %u over [%llu, %llu)\n", range.task_id,
+           static_cast<unsigned long long>(range.start), static_cast<unsigned long long>(range.end));
+    running.push_back({range.task_id, pid, pipe_fds[0], 0});
+    return true;
+}
+
+void PeerWorker::cancel_task(uint32_t task_id) {
+    // Another worker finished the range first, no DONE is expected
+    if (aggregating) {
+        pthread_mutex_lock(&aggregate_mutex);
+        reducer.abort(task_id);
+        pthread_mutex_unlock(&aggregate_mutex);
+    }
+    for (size_t slot = 0; slot < running.size(); slot++) {
+        RunningTask& task = running[slot];
+        if (task.id != task_id) {
+            continue;
+        }
+        kill(task.pid, SIGKILL);
+        waitpid(task.pid, nullptr, 0);
+        close(task.out_fd);
+        printf("Task %u cancelled after %llu bytes\n", task.id, static_cast<unsigned long long>(task.bytes_sent));
+
+        running.erase(running.begin() + slot);
+        start_waiting();
+        return;
+    }
+
+    // A warm runner is killed with its task, the slot starts a fresh one when needed
+    for (WarmRunner& runner : runners) {
+        if (runner.busy && runner.task_id == task_id) {
+            printf("Task %u cancelled after %llu bytes\n", task_id, static_cast<unsigned long long>(runner.bytes_sent));
+            stop_runner(runner);
+            start_waiting();
+            return;
+        }
+    }
+
+    waiting.erase(std::remove_if(waiting.begin(), waiting.end(),
+                                 [task_id](const TaskRange& range) { return range.task_id == task_id; }),
+                  waiting.end());
+}
+
+void PeerWorker::start_waiting() {
+    // The coordinator never sends more than our slots, this only guards against a misbehaving one
+    size_t active = running.size();
+    for (const WarmRunner& runner : runners) {
+        active += runner.busy ? 1 : 0;
+    }
+    for (; active < static_cast<size_t>(config.slots) && !waiting.empty(); active++) {
+        TaskRange range = waiting.front();
+        waiting.pop_front();
+        start_task(range);
+    }
+}
+
+bool PeerWorker::pump_task(size_t slot) {
+    RunningTask& task = running[slot];
+
+    // Task id in front, output straight behind it in the same buffer
+    uint32_t net_id = htonl(task.id);
+    memcpy(io_buf, &net_id, sizeof(net_id));
+    ssize_t n = read(task.out_fd, io_buf + 4, WORKER_CHUNK_SIZE - 4);
+    if (n < 0 && errno == EINTR) {
+        return true;
+    }
+
+    if (n > 0) {
+        task.bytes_sent += n;
+        if (aggregating) {
+            fold_output(task.id, io_buf + 4, n);
+            return true;
+        }
+        pthread_mutex_lock(&send_mutex);
+        bool ok = conn.send_frame(MsgType::RESULT_CHUNK, io_buf, n + 4);
+        pthread_mutex_unlock(&send_mutex);
+        return ok;
+    }
+
+    // Output closed, the process is done
+    int wstatus = 0;
+    close(task.out_fd);
+    waitpid(task.pid, &wstatus, 0);
+
+    TaskDone done;
+    done.task_id = task.id;
+    done.status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128 + WTERMSIG(wstatus);
+    done.bytes = task.bytes_sent;
+    printf("Task %u finished with status %d, %llu bytes\n", task.id, done.status,
+           static_cast<unsigned long long>(task.bytes_sent));
+
+    running.erase(running.begin() + slot);
+    bool ok = send_done(done);
+    start_waiting();
+    return ok;
+}
+
+int PeerWorker::run() {
+    struct addrinfo hints;
+    struct addrinfo* result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    std::string port = std::to_string(config.port);
+    if (getaddrinfo(config.host.c_str(), port.c_str(), &hints, &result) != 0) {
+        fprintf(stderr, "Unable to resolve %s\n", config.host.c_str());
+        return 1;
+    }
+
+    conn.client_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (conn.client_fd < 0 || connect(conn.client_fd, result->ai_addr, result->ai_addrlen) < 0) {
+        perror("connect failed");
+        freeaddrinfo(result);
+        return 1;
+    }
+    freeaddrinfo(result);
+
+    int opt = 1;
+    setsockopt(conn.client_fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    printf("Connected to %s:%d\n", config.host.c_str(), config.port);
+
+    start_relay_listener();
+    Hello hello;
+    hello.relay_port = relay_port;
+    hello.slots = static_cast<uint16_t>(std::min(config.slots, 65535));
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGE_SIZE);
+    hello.memory_bytes = pages > 0 && page_size > 0 ? static_cast<uint64_t>(pages) * page_size : 0;
+    hello.score = config.benchmark ? run_benchmark() : 0;
+    hello.flags = HELLO_CAN_REDUCE;
+    printf("Offering %u task slots, %llu MB, score %u\n", hello.slots,
+           static_cast<unsigned long long>(hello.memory_bytes >> 20), hello.score);
+    if (!send_control(MsgType::HELLO, encode_hello(hello))) {
+        return 1;
+    }
+
+    std::vector<struct pollfd> fds;
+    std::vector<size_t> polled_runners;
+    while (1) {
+        if (!flush_partials(false)) {
+            fprintf(stderr, "Lost connection to coordinator\n");
+            return 1;
+        }
+
+        fds.clear();
+        polled_runners.clear();
+        fds.push_back({conn.client_fd, POLLIN, 0});
+        for (const RunningTask& task : running) {
+            fds.push_back({task.out_fd, POLLIN, 0});
+        }
+        size_t task_fds = fds.size();
+        for (size_t slot = 0; slot < runners.size(); slot++) {
+            if (runners[slot].pid >= 0) {
+                fds.push_back({runners[slot].out_fd, POLLIN, 0});
+                polled_runners.push_back(slot);
+            }
+        }
+
+        // Folded output waits for the next flush, wake up for it
+        if (poll(fds.data(), fds.size(), aggregating ? AGGREGATE_FLUSH_MS : -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            return 1;
+        }
+
+        // Runners keep their slots. One may be replaced while another is
+        // pumped, its pipe is non-blocking so a stale event reads nothing.
+        for (size_t i = 0; i < polled_runners.size(); i++) {
+            if ((fds[task_fds + i].revents & (POLLIN | POLLHUP | POLLERR)) && !pump_runner(polled_runners[i])) {
+                fprintf(stderr, "Lost connection to coordinator\n");
+                return 1;
+            }
+        }
+
+        // Task output first, the slot indices shift once a task finishes
+        for (size_t i = task_fds - 1; i >= 1; i--) {
+            if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) && !pump_task(i - 1)) {
+                fprintf(stderr, "Lost connection to coordinator\n");
+                return 1;
+            }
+        }
+
+        if (!(fds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+            continue;
+        }
+
+        ssize_t n = recv(conn.client_fd, io_buf, WORKER_CHUNK_SIZE, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            printf("Coordinator closed the connection\n");
+            return 0;
+        }
+        conn.reader.feed(io_buf, n);
+
+        // Control frames are small and read whole, SCRIPT is streamed
+        MsgType type;
+        uint32_t length;
+        int status;
+        while ((status = conn.reader.next_header(type, length)) > 0) {
+            if (type == MsgType::SCRIPT) {
+                std::string path = receive_payload(conn, length, have_plan ? &plan : nullptr);
+                have_plan = false;
+
+                pthread_mutex_lock(&state_mutex);
+                script_path = path;
+                pthread_mutex_unlock(&state_mutex);
+                printf("Received %u byte script into %s\n", length, path.c_str());
+                continue;
+            }
+
+            Frame frame;
+            frame.type = type;
+            if (!read_payload(conn, length, frame.payload) || !handle_frame(frame)) {
+                fprintf(stderr, "Lost connection to coordinator\n");
+                return 1;
+            }
+        }
+        if (status < 0) {
+            fprintf(stderr, "Malformed frame from coordinator\n");
+            return 1;
+        }
+    }
+}
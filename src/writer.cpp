@@ -0,0 +1,191 @@
+#include <writer.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <algorithm>
+#include <sys/uio.h>
+
+ResultWriter::ResultWriter(size_t slot_count, size_t slot_size) : slots(slot_count) {
+    for (Slot& slot : slots) {
+        slot.data.resize(slot_size);
+    }
+}
+
+ResultWriter::~ResultWriter() {
+    close();
+}
+
+bool ResultWriter::open(const std::string& path) {
+    if (fd >= 0) {
+        return true;
+    }
+
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror(("Error opening file: " + path).c_str());
+        return false;
+    }
+
+    stopping = false;
+    failed_errno = 0;
+    if (pthread_create(&thread, NULL, writer_thread_fn, this) != 0) {
+        perror("writer thread");
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+    return true;
+}
+
+void ResultWriter::write(const char* data, size_t len) {
+    pthread_mutex_lock(&mutex);
+
+    while (len > 0) {
+        // Top up the last slot unless the writer already owns it
+        if (used > writing) {
+            Slot& tail = slots[(head + used - 1) % slots.size()];
+            if (tail.len < tail.data.size()) {
+                size_t n = std::min(len, tail.data.size() - tail.len);
+                memcpy(tail.data.data() + tail.len, data, n);
+                tail.len += n;
+                data += n;
+                len -= n;
+                continue;
+            }
+        }
+
+        if (used == slots.size()) {
+            // Ring is full, let the disk catch up
+            pthread_cond_signal(&data_cond);
+            pthread_cond_wait(&space_cond, &mutex);
+            continue;
+        }
+        slots[(head + used) % slots.size()].len = 0;
+        used++;
+    }
+
+    pthread_cond_signal(&data_cond);
+    pthread_mutex_unlock(&mutex);
+}
+
+void ResultWriter::flush() {
+    pthread_mutex_lock(&mutex);
+    while (fd >= 0 && used > 0) {
+        pthread_cond_wait(&space_cond, &mutex);
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+bool ResultWriter::truncate(uint64_t size) {
+    flush();
+    // O_APPEND puts the next write at the new end
+    if (fd < 0 || ftruncate(fd, static_cast<off_t>(size)) < 0) {
+        perror("Error truncating file");
+        return false;
+    }
+    pthread_mutex_lock(&mutex);
+    failed_errno = 0;
+    pthread_mutex_unlock(&mutex);
+    return true;
+}
+
+int ResultWriter::error() {
+    pthread_mutex_lock(&mutex);
+    int err = failed_errno;
+    pthread_mutex_unlock(&mutex);
+    return err;
+}
+
+void ResultWriter::close() {
+    if (fd < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&mutex);
+    stopping = true;
+    pthread_cond_signal(&data_cond);
+    pthread_mutex_unlock(&mutex);
+
+    pthread_join(thread, NULL);
+    ::close(fd);
+    fd = -1;
+}
+
+// Writes slots [first, first + count) in as few writev calls as possible
+bool ResultWriter::write_all(size_t first, size_t count) {
+    std::vector<struct iovec> iov;
+    for (size_t i = 0; i < count; i++) {
+        Slot& slot = slots[(first + i) % slots.size()];
+        if (slot.len > 0) {
+            iov.push_back({slot.data.data(), slot.len});
+        }
+    }
+
+    size_t start = 0;
+    while (start < iov.size()) {
+        int n_iov = static_cast<int>(std::min<size_t>(iov.size() - start, IOV_MAX));
+        ssize_t n = writev(fd, &iov[start], n_iov);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+
+        // Skip what made it out, a short write leaves a partial iovec
+        size_t done = static_cast<size_t>(n);
+        while (start < iov.size() && done >= iov[start].iov_len) {
+            done -= iov[start].iov_len;
+            start++;
+        }
+        if (start < iov.size()) {
+            iov[start].iov_base = static_cast<char*>(iov[start].iov_base) + done;
+            iov[start].iov_len -= done;
+        }
+    }
+    return true;
+}
+
+void ResultWriter::write_loop() {
+    pthread_mutex_lock(&mutex);
+
+    while (true) {
+        while (used == 0 && !stopping) {
+            pthread_cond_wait(&data_cond, &mutex);
+        }
+        if (used == 0) {
+            break;
+        }
+
+        // Take everything queued so far, including a partly filled tail
+        size_t first = head;
+        size_t count = used;
+        writing = count;
+        bool skip = failed_errno != 0;
+        pthread_mutex_unlock(&mutex);
+
+        // Once a write failed, output after it would land out of place
+        int err = 0;
+        if (!skip && !write_all(first, count)) {
+            err = errno;
+            perror("Error writing to file");
+        }
+
+        pthread_mutex_lock(&mutex);
+        if (err != 0 && failed_errno == 0) {
+            failed_errno = err;
+        }
+        for (size_t i = 0; i < count; i++) {
+            slots[(first + i) % slots.size()].len = 0;
+        }
+        head = (head + count) % slots.size();
+        used -= count;
+        writing = 0;
+        pthread_cond_broadcast(&space_cond);
+    }
+
+    pthread_mutex_unlock(&mutex);
+}